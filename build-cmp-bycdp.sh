@@ -4,7 +4,7 @@ mkdir -p bin
 export SOURCE_FILES="cmp-bycdp/seismicunix.cpp cmp-bycdp/semblance.cpp "
 COMPILER="g++" # Change this to your favorite compiler
 ALLFLAGS="-I./spitz-include/ccpp/"
-SFLAGS="-DSPITZ_SERIAL_DEBUG" # Flags for serial build
+SFLAGS="-DSPITZ_SERIAL_DEBUG -pthread" # Flags for serial build
 RFLAGS="-fPIC -shared" # Flags for building a shared object
 
 #CMP
@@ -13,3 +13,5 @@ echo Building cmp-bycdp as module...
 $COMPILER $ALLFLAGS -o ./bin/cmp-bycdp/cmp-bycdp-module ./cmp-bycdp/main.cpp $SOURCE_FILES $RFLAGS || exit 1
 echo Building cmp-bycdp as serial...
 $COMPILER $ALLFLAGS -o ./bin/cmp-bycdp/cmp-bycdp-serial ./cmp-bycdp/main.cpp $SOURCE_FILES $SFLAGS || exit 1
+echo Building cmp-bycdp velocity analysis service...
+$COMPILER $ALLFLAGS -o ./bin/cmp-bycdp/cmp-bycdp-servico ./cmp-bycdp/servico.cpp $SOURCE_FILES -pthread || exit 1
@@ -4,7 +4,7 @@ mkdir -p bin
 export SOURCE_FILES="cmp-bysamples/seismicunix.cpp cmp-bysamples/semblance.cpp "
 COMPILER="g++" # Change this to your favorite compiler
 ALLFLAGS="-I./spitz-include/ccpp/"
-SFLAGS="-DSPITZ_SERIAL_DEBUG" # Flags for serial build
+SFLAGS="-DSPITZ_SERIAL_DEBUG -pthread" # Flags for serial build
 RFLAGS="-fPIC -shared" # Flags for building a shared object
 
 #CMP
@@ -5,7 +5,7 @@ export SOURCE_FILES="cmp/seismicunix.cpp cmp/semblance.cpp "
 COMPILER="g++" # Change this to your favorite compiler
 #export SPITS_INCLUDE = "-Icmp/include/"
 ALLFLAGS="-I./spitz-include/ccpp/"
-SFLAGS="-DSPITZ_SERIAL_DEBUG" # Flags for serial build
+SFLAGS="-DSPITZ_SERIAL_DEBUG -pthread" # Flags for serial build
 RFLAGS="-fPIC -shared" # Flags for building a shared object
 
 #CMP
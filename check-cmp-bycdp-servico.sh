@@ -0,0 +1,65 @@
+#!/bin/bash
+# Compares the cmp reply of the velocity analysis service for the first CDP
+# of the output with the traces cmp-bycdp writes for it. Needs the binaries
+# of build-cmp-bycdp.sh and python3.
+if [ $# -lt 7 ]; then
+    echo "usage: $0 <file> V_INI V_FIN V_INT WIND APH AZIMUTH"
+    exit 1
+fi
+
+BIN=$(cd "$(dirname "$0")" && pwd)/bin/cmp-bycdp
+DIR=$(mktemp -d)
+trap 'kill $SERVICO 2>/dev/null; rm -rf "$DIR"' EXIT
+
+cp "$1" "$DIR/dado.su" || exit 1
+shift
+cd "$DIR"
+
+echo Running cmp-bycdp...
+"$BIN/cmp-bycdp-serial" dado.su "$@" --diario=0 > cmp-bycdp.log 2>&1 || { echo "cmp-bycdp failed"; exit 1; }
+
+echo Starting the service...
+"$BIN/cmp-bycdp-servico" dado.su servico.sock > servico.log 2>&1 &
+SERVICO=$!
+for i in $(seq 50); do
+    [ -S servico.sock ] && break
+    sleep 0.1
+done
+
+python3 - "$@" <<'EOF'
+import socket, struct, sys
+
+def traco(nome):
+    with open(nome, 'rb') as f:
+        cabecalho = f.read(240)
+        ns = struct.unpack('=h', cabecalho[114:116])[0]
+        cdp = struct.unpack('=i', cabecalho[20:24])[0]
+        return cdp, struct.unpack('=%df' % ns, f.read(4 * ns))
+
+cdp, pilha = traco('dado-empilhado.out3.su')
+_, semblance = traco('dado-semblance.out3.su')
+_, velocidade = traco('dado-V.out3.su')
+
+s = socket.socket(socket.AF_UNIX)
+s.connect('servico.sock')
+s.sendall(('cmp %d %s\n' % (cdp, ' '.join(sys.argv[1:]))).encode())
+resposta = b''
+while b'\n' not in resposta:
+    resposta += s.recv(4096)
+linha, dados = resposta.split(b'\n', 1)
+if not linha.startswith(b'ok'):
+    print('service error: %s' % linha.decode())
+    sys.exit(1)
+ns = int(linha.split()[1])
+while len(dados) < 12 * ns:
+    dados += s.recv(65536)
+s.sendall(b'fim\n')
+valores = struct.unpack('=%df' % (3 * ns), dados[:12 * ns])
+
+diferentes = [a for a in range(ns) if (valores[3*a], valores[3*a+1], valores[3*a+2]) !=
+    (pilha[a], semblance[a], velocidade[a])]
+if diferentes:
+    print('CDP %d: %d of %d samples differ, first at sample %d' % (cdp, len(diferentes), ns, diferentes[0]))
+    sys.exit(1)
+print('CDP %d: service and cmp-bycdp agree on all %d samples' % (cdp, ns))
+EOF
@@ -39,11 +39,33 @@
 #include <limits>
 #include <vector>
 #include <cmath>
+#include <cfloat>
 #include <cstring>
 #include <iomanip>
+#include <map>
+#include <list>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
 #include <stdio.h>
 #include "semblance.h"
 #include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <utime.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+
+// Version of the results computed by the worker, part of the key of the
+// result cache. It must change whenever the worker changes its results.
+#define VERSAO_RESULTADOS 2
+//O diario e sincronizado a cada DIARIO_CDPS CDPs gravados ou DIARIO_SEGUNDOS
+#define DIARIO_CDPS 64
+#define DIARIO_SEGUNDOS 1
 
 
 void SetCabecalhoCMP(Traco *traco)
@@ -66,6 +88,26 @@ void LiberarMemoria(ListaTracos ***lista, int *tamanho)
 }
 
 
+// One set of search parameters. The first comes from the command line and
+// the others from --varredura, each of them searched in every azimuth of
+// --azimutes in the same job.
+struct busca
+{
+    float Vini, Vfin, Vint;
+    float wind, aph, azimuth;
+};
+
+// Common-reflection-surface search, enabled by --crs with the midpoint
+// aperture of the neighbor CDPs. A and B are searched after the velocity,
+// over the supergather of the CDP and its neighbors.
+struct buscaCRS
+{
+    float md;
+    float Aini, Afin, Aint;
+    float Bini, Bfin, Bint;
+    float limiar;
+};
+
 // Parameters should not be stored inside global variables because the
 // Spitz interface does not guarantee memory isolation between job
 // manager, committer and workers. This can lead to a race condition when
@@ -79,12 +121,42 @@ struct parameters
     std::string arquivo;
     ListaTracos **listaTracos = NULL;
     int tamanhoLista;
+    std::map<std::string, std::string> opcoes;
+    bool referencia;
+    int velocidades;
+    int lote;
+    long carga;
+    bool lpt;
+    std::string calibracao;
+    std::string saida, diario;
+    std::string resultados;
+    long limiteResultados;
+    int fluxo;
+    int antecipacao;
+    std::vector<busca> buscas;
+    std::vector<float> azimutes;
+    buscaCRS crs;
+    float continuidade, limiarContinuidade;
 
     parameters(int argc, const char *argv[], const std::string& who = "") :
         who(who)
     {
-        if (argc < 8) {
-            std::cerr << "ERRO: ./main <dado sismico> V_INI V_FIN V_INT WIND APH AZIMUTH" << std::endl;
+        std::vector<const char*> args;
+        const char *igual;
+        int i;
+
+        //Opcoes no formato --nome=valor podem aparecer em qualquer posicao
+        for(i=0; i<argc; i++){
+            if(strncmp(argv[i], "--", 2) == 0){
+                igual = strchr(argv[i], '=');
+                if(igual) opcoes[std::string(argv[i]+2, igual)] = igual+1;
+                else opcoes[argv[i]+2] = "1";
+            }
+            else args.push_back(argv[i]);
+        }
+
+        if (args.size() < 8) {
+            std::cerr << "ERRO: ./main <dado sismico> V_INI V_FIN V_INT WIND APH AZIMUTH [OPCOES]" << std::endl;
             std::cerr << "\tARQUIVO: arquivo dos tracos sismicos" << std::endl;
             std::cerr << "\tV_INI:   velocidade inicial" << std::endl;
             std::cerr << "\tV_FIN:   velocidade final" << std::endl;
@@ -92,17 +164,195 @@ struct parameters
             std::cerr << "\tWIND:    janela do semblance" << std::endl;
             std::cerr << "\tAPH:     aperture" << std::endl;
             std::cerr << "\tAZIMUTH: azimuth" << std::endl;
+            std::cerr << "\t--referencia: envia a posicao dos tracos no arquivo em vez das amostras" << std::endl;
+            std::cerr << "\t--velocidades=N: velocidades avaliadas por tarefa (padrao V_INT)" << std::endl;
+            std::cerr << "\t--lote=K:     CDPs por tarefa (padrao 1)" << std::endl;
+            std::cerr << "\t--carga=KB:   escolhe os CDPs por tarefa pelo tamanho da tarefa" << std::endl;
+            std::cerr << "\t--ordem=lpt:  envia primeiro os CDPs mais custosos" << std::endl;
+            std::cerr << "\t--calibracao=ARQUIVO: tempos de cada CDP, lidos pela ordem lpt e gravados ao fim" << std::endl;
+            std::cerr << "\t--diario=ARQUIVO: CDPs ja gravados, para retomar a execucao (0 desliga)" << std::endl;
+            std::cerr << "\t--resultados=DIR: cache em disco dos resultados de cada CDP" << std::endl;
+            std::cerr << "\t--limiteresultados=MB: tamanho maximo da cache de resultados (padrao 1024)" << std::endl;
+            std::cerr << "\t--fluxo=N:    envia os CDPs enquanto o arquivo ordenado por CDP e lido, ate N na fila" << std::endl;
+            std::cerr << "\t--antecipacao=N: CDPs lidos antecipadamente pelo sistema (padrao 4)" << std::endl;
+            std::cerr << "\t--varredura=V_INI,V_FIN,V_INT,WIND,APH/...: outros parametros avaliados na mesma leitura" << std::endl;
+            std::cerr << "\t--azimutes=A,...: outros azimutes avaliados na mesma leitura" << std::endl;
+            std::cerr << "\t--crs=MD:    busca CRS de A e B com os CDPs vizinhos ate MD do ponto medio" << std::endl;
+            std::cerr << "\t--crsa=A_INI,A_FIN,A_INT: valores de A avaliados (padrao -0.0005,0.0005,21)" << std::endl;
+            std::cerr << "\t--crsb=B_INI,B_FIN,B_INT: valores de B avaliados (padrao -0.0000001,0.0000001,21)" << std::endl;
+            std::cerr << "\t--crslimiar=S: semblance minimo da velocidade para buscar A e B (padrao 0)" << std::endl;
+            std::cerr << "\t--continuidade=DV: busca cada CDP do lote ate DV da velocidade do CDP anterior" << std::endl;
+            std::cerr << "\t--continuidadelimiar=S: semblance minimo do CDP anterior para usar o corredor (padrao 0.1)" << std::endl;
             exit(1);
         }   
 
         //Leitura dos parametros
-        arquivo = argv[1];
-        Vini = atof(argv[2]);
-        Vfin = atof(argv[3]);
-        Vint = atof(argv[4]);
-        wind = atof(argv[5]);
-        aph = atof(argv[6]);
-        azimuth = atof(argv[7]);
+        arquivo = args[1];
+        Vini = atof(args[2]);
+        Vfin = atof(args[3]);
+        Vint = atof(args[4]);
+        wind = atof(args[5]);
+        aph = atof(args[6]);
+        azimuth = atof(args[7]);
+        buscas.push_back(busca{ Vini, Vfin, Vint, wind, aph, azimuth });
+        lerVarredura(opcao("varredura", ""));
+        lerAzimutes(opcao("azimutes", ""));
+        referencia = atoi(opcao("referencia", "0").c_str()) != 0;
+        velocidades = atoi(opcao("velocidades", "0").c_str());
+        if(velocidades <= 0 || velocidades > VintMaximo()) velocidades = VintMaximo();
+        lote = atoi(opcao("lote", "1").c_str());
+        if(lote < 1) lote = 1;
+        carga = atol(opcao("carga", "0").c_str()) << 10;
+        lpt = opcao("ordem", "arquivo") == "lpt";
+        calibracao = opcao("calibracao", "");
+        //Nome dos arquivos de saida sem a extensao .su
+        saida = arquivo.substr(0, arquivo.size() > 3 ? arquivo.size() - 3 : 0);
+        diario = opcao("diario", saida + ".out3.diario");
+        if(diario == "0") diario = "";
+        resultados = opcao("resultados", "");
+        limiteResultados = atol(opcao("limiteresultados", "1024").c_str()) << 20;
+        fluxo = atoi(opcao("fluxo", "0").c_str());
+        antecipacao = atoi(opcao("antecipacao", "4").c_str());
+        lerCRS();
+        lerContinuidade();
+    }
+
+    // Each CDP of a batch is searched around the picks of the previous one,
+    // so the batch must go in file order and have the whole velocity range
+    void lerContinuidade()
+    {
+        continuidade = atof(opcao("continuidade", "0").c_str());
+        limiarContinuidade = atof(opcao("continuidadelimiar", "0.1").c_str());
+        if(continuidade <= 0) return;
+        if(crs.md > 0 || !resultados.empty()){
+            std::cerr << "ERRO: --continuidade nao aceita --crs nem --resultados" << std::endl;
+            exit(1);
+        }
+        velocidades = VintMaximo();
+    }
+
+    // The search of A and B needs the best velocity of the whole list, so
+    // each CDP is a single task, and the neighbors of a CDP must be known
+    // before it is sent
+    void lerCRS()
+    {
+        char resto;
+        crs = buscaCRS();
+        crs.md = atof(opcao("crs", "0").c_str());
+        if(crs.md <= 0) return;
+        if(sscanf(opcao("crsa", "-0.0005,0.0005,21").c_str(), "%f,%f,%f%c", &crs.Aini, &crs.Afin, &crs.Aint, &resto) != 3 ||
+            sscanf(opcao("crsb", "-0.0000001,0.0000001,21").c_str(), "%f,%f,%f%c", &crs.Bini, &crs.Bfin, &crs.Bint, &resto) != 3 ||
+            (int) crs.Aint < 1 || (int) crs.Bint < 1){
+            std::cerr << "ERRO: --crsa e --crsb esperam INI,FIN,INT" << std::endl;
+            exit(1);
+        }
+        crs.limiar = atof(opcao("crslimiar", "0").c_str());
+        if(buscas.size() > 1 || fluxo > 0){
+            std::cerr << "ERRO: --crs nao aceita --varredura, --azimutes nem --fluxo" << std::endl;
+            exit(1);
+        }
+        velocidades = VintMaximo();
+    }
+
+    // Extra sets of parameters, separated by '/'
+    void lerVarredura(const std::string& varredura)
+    {
+        std::istringstream lista(varredura);
+        std::string item;
+        busca b;
+        char resto;
+
+        while(std::getline(lista, item, '/')){
+            if(sscanf(item.c_str(), "%f,%f,%f,%f,%f%c", &b.Vini, &b.Vfin, &b.Vint, &b.wind, &b.aph, &resto) != 5 ||
+                (int) b.Vint < 1){
+                std::cerr << "ERRO: --varredura espera V_INI,V_FIN,V_INT,WIND,APH separados por /: " << item << std::endl;
+                exit(1);
+            }
+            b.azimuth = azimuth;
+            buscas.push_back(b);
+        }
+    }
+
+    // Extra azimuths, separated by ','. Every set of parameters is
+    // searched in each azimuth, the azimuths of a set stay together.
+    void lerAzimutes(const std::string& lista)
+    {
+        std::istringstream valores(lista);
+        std::string item;
+        std::vector<busca> conjuntos;
+        char *fim;
+        size_t k, j;
+
+        azimutes.push_back(azimuth);
+        while(std::getline(valores, item, ',')){
+            azimutes.push_back(strtof(item.c_str(), &fim));
+            if(item.empty() || *fim != '\0'){
+                std::cerr << "ERRO: --azimutes espera azimutes separados por virgula: " << item << std::endl;
+                exit(1);
+            }
+        }
+        conjuntos.swap(buscas);
+        for(k=0; k<conjuntos.size(); k++){
+            for(j=0; j<azimutes.size(); j++){
+                buscas.push_back(conjuntos[k]);
+                buscas.back().azimuth = azimutes[j];
+            }
+        }
+    }
+
+    // The gathers are read once with the largest aperture and the tasks
+    // cover the longest list of velocities. The aperture in one azimuth
+    // does not bound another, so with several azimuths all traces are read
+    // and each search selects its own.
+    float aphLeitura() const
+    {
+        float maior = 0;
+        if(azimutes.size() > 1) return FLT_MAX;
+        for(size_t k=0; k<buscas.size(); k++)
+            maior = std::max(maior, buscas[k].aph);
+        return maior;
+    }
+
+    int VintMaximo() const
+    {
+        int maior = 0;
+        for(size_t k=0; k<buscas.size(); k++)
+            maior = std::max(maior, (int) buscas[k].Vint);
+        return maior;
+    }
+
+    // Velocities the worker evaluates for each CDP, one window per set of
+    // parameters and velocity
+    long VelocidadesAvaliadas() const
+    {
+        long total = 0;
+        for(size_t k=0; k<buscas.size(); k++)
+            total += (int) buscas[k].Vint;
+        return total;
+    }
+
+    // Number of tasks of each CDP
+    int faixas() const
+    {
+        return (VintMaximo() + velocidades - 1) / velocidades;
+    }
+
+    // Output file of a search, named after its set of parameters and its
+    // azimuth. The first set in the first azimuth keeps the usual names.
+    std::string nomeSaida(size_t k, const std::string& tipo) const
+    {
+        std::ostringstream nome;
+        nome << saida;
+        if(k / azimutes.size() > 0) nome << "-p" << k / azimutes.size();
+        if(k % azimutes.size() > 0) nome << "-a" << k % azimutes.size();
+        nome << "-" << tipo << ".out3.su";
+        return nome.str();
+    }
+
+    std::string opcao(const std::string& nome, const std::string& padrao) const
+    {
+        std::map<std::string, std::string>::const_iterator it = opcoes.find(nome);
+        return it == opcoes.end() ? padrao : it->second;
     }
 
     void print()
@@ -114,6 +364,230 @@ struct parameters
     }
 };
 
+uint64_t HashFNV(const void *dados, size_t tamanho, uint64_t h = 14695981039346656037ULL)
+{
+    const unsigned char *p = (const unsigned char*) dados;
+    size_t i;
+    for(i=0; i<tamanho; i++){
+        h ^= p[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// Results of previous tasks, one file per CDP and range of velocities in a
+// directory, named after a hash of everything the result depends on. The
+// least recently used files are removed when the directory grows above the
+// limit. Processes sharing the directory keep their own index, built from
+// the modification times, so a file removed by another process is a miss.
+class cache_resultados
+{
+private:
+    typedef std::list<std::pair<uint64_t, long> > lista;
+
+    std::mutex m;
+    std::string diretorio;
+    lista lru;
+    std::map<uint64_t, lista::iterator> indice;
+    long bytes;
+    long acertos, faltas, descartes;
+    int usuarios;
+
+    cache_resultados() : bytes(0), acertos(0), faltas(0), descartes(0), usuarios(0) { }
+
+    std::string caminho(uint64_t id) const
+    {
+        char nome[32];
+        snprintf(nome, sizeof(nome), "/%016llx.res", (unsigned long long) id);
+        return diretorio + nome;
+    }
+
+    // Indexes the files already in the directory, most recent first
+    void abrir(const std::string& dir)
+    {
+        std::vector<std::pair<time_t, std::pair<uint64_t, long> > > arquivos;
+        struct dirent *entrada;
+        struct stat st;
+        unsigned long long id;
+        char sufixo[8];
+        DIR *d;
+        size_t i;
+
+        if(dir == diretorio) return;
+        diretorio = dir;
+        lru.clear();
+        indice.clear();
+        bytes = 0;
+        mkdir(dir.c_str(), 0755);
+        if(!(d = opendir(dir.c_str()))) return;
+        while((entrada = readdir(d))){
+            if(sscanf(entrada->d_name, "%16llx.%3s", &id, sufixo) != 2 || strcmp(sufixo, "res") != 0 ||
+                stat((dir + "/" + entrada->d_name).c_str(), &st) != 0)
+                continue;
+            arquivos.push_back(std::make_pair(st.st_mtime, std::make_pair((uint64_t) id, (long) st.st_size)));
+        }
+        closedir(d);
+        std::sort(arquivos.begin(), arquivos.end());
+        for(i=arquivos.size(); i>0; i--){
+            lru.push_back(arquivos[i-1].second);
+            indice[lru.back().first] = --lru.end();
+            bytes += lru.back().second;
+        }
+    }
+
+public:
+    static cache_resultados& instancia()
+    {
+        static cache_resultados c;
+        return c;
+    }
+
+    bool buscar(const std::string& dir, uint64_t id, int ns, float *pilhas, float *semblances, float *velocidades)
+    {
+        std::string nome;
+        int versao, n;
+        bool ok;
+        {
+            std::lock_guard<std::mutex> lock(m);
+            abrir(dir);
+            nome = caminho(id);
+        }
+
+        FILE *arquivo = fopen(nome.c_str(), "rb");
+        ok = arquivo && fread(&versao, sizeof(int), 1, arquivo) == 1 && versao == VERSAO_RESULTADOS &&
+            fread(&n, sizeof(int), 1, arquivo) == 1 && n == ns &&
+            fread(pilhas, sizeof(float), ns, arquivo) == (size_t) ns &&
+            fread(semblances, sizeof(float), ns, arquivo) == (size_t) ns &&
+            fread(velocidades, sizeof(float), ns, arquivo) == (size_t) ns;
+        if(arquivo) fclose(arquivo);
+        //A data de modificacao guarda o uso para os outros processos
+        if(ok) utime(nome.c_str(), NULL);
+
+        std::lock_guard<std::mutex> lock(m);
+        std::map<uint64_t, lista::iterator>::iterator it = indice.find(id);
+        if(ok){
+            acertos++;
+            //Mais recentemente usado no inicio da lista
+            if(it != indice.end()) lru.splice(lru.begin(), lru, it->second);
+        }
+        else{
+            faltas++;
+            if(it != indice.end()){
+                bytes -= it->second->second;
+                lru.erase(it->second);
+                indice.erase(it);
+            }
+        }
+        return ok;
+    }
+
+    // The file is written under a temporary name and renamed, so a reader
+    // never sees a partial result
+    void inserir(const std::string& dir, uint64_t id, int ns, const float *pilhas, const float *semblances,
+        const float *velocidades, long limite)
+    {
+        std::ostringstream temporario;
+        std::string nome;
+        int versao = VERSAO_RESULTADOS;
+        long tamanho = 2 * sizeof(int) + 3 * sizeof(float) * ns;
+        bool ok;
+        {
+            std::lock_guard<std::mutex> lock(m);
+            abrir(dir);
+            nome = caminho(id);
+        }
+        temporario << nome << "." << getpid() << "." << std::this_thread::get_id() << ".tmp";
+
+        FILE *arquivo = fopen(temporario.str().c_str(), "wb");
+        ok = arquivo && fwrite(&versao, sizeof(int), 1, arquivo) == 1 &&
+            fwrite(&ns, sizeof(int), 1, arquivo) == 1 &&
+            fwrite(pilhas, sizeof(float), ns, arquivo) == (size_t) ns &&
+            fwrite(semblances, sizeof(float), ns, arquivo) == (size_t) ns &&
+            fwrite(velocidades, sizeof(float), ns, arquivo) == (size_t) ns;
+        if(arquivo) ok = fclose(arquivo) == 0 && ok;
+        if(!ok || rename(temporario.str().c_str(), nome.c_str()) != 0){
+            unlink(temporario.str().c_str());
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(m);
+        if(indice.count(id)) return;
+        lru.push_front(std::make_pair(id, tamanho));
+        indice[id] = lru.begin();
+        bytes += tamanho;
+        while(bytes > limite && lru.size() > 1){
+            bytes -= lru.back().second;
+            unlink(caminho(lru.back().first).c_str());
+            indice.erase(lru.back().first);
+            lru.pop_back();
+            descartes++;
+        }
+    }
+
+    void estatisticas(long *a, long *f, long *d)
+    {
+        std::lock_guard<std::mutex> lock(m);
+        *a = acertos;
+        *f = faltas;
+        *d = descartes;
+    }
+
+    // The cache is shared by the workers of the process, the last one to
+    // leave reports the statistics
+    void entrar()
+    {
+        std::lock_guard<std::mutex> lock(m);
+        usuarios++;
+    }
+
+    bool sair()
+    {
+        std::lock_guard<std::mutex> lock(m);
+        return --usuarios == 0;
+    }
+};
+
+// The journal lists the CDPs whose results are already in the output files.
+// Its first line identifies the input file and the parameters that change
+// the results, so that only a restart of the same job skips those CDPs.
+std::string ChaveDiario(const parameters& p)
+{
+    std::ostringstream chave;
+    long tamanho = 0, modificacao = 0;
+    IdentidadeArquivoSU(p.arquivo.c_str(), &tamanho, &modificacao);
+    chave << "cmp-bycdp " << p.arquivo << " " << tamanho << " " << modificacao
+        << " " << p.Vini << " " << p.Vfin
+        << " " << p.Vint << " " << p.wind << " " << p.aph << " " << p.azimuth;
+    for(size_t k=1; k<p.buscas.size(); k++)
+        chave << " / " << p.buscas[k].Vini << " " << p.buscas[k].Vfin << " " << p.buscas[k].Vint
+            << " " << p.buscas[k].wind << " " << p.buscas[k].aph << " " << p.buscas[k].azimuth;
+    if(p.crs.md > 0)
+        chave << " crs " << p.crs.md << " " << p.crs.Aini << " " << p.crs.Afin << " " << p.crs.Aint
+            << " " << p.crs.Bini << " " << p.crs.Bfin << " " << p.crs.Bint << " " << p.crs.limiar;
+    if(p.continuidade > 0)
+        chave << " continuidade " << p.continuidade << " " << p.limiarContinuidade;
+    return chave.str();
+}
+
+// Marks the CDPs found in the journal and returns whether it belongs to the
+// same job. A line cut by a crash has no newline and is ignored.
+bool LerDiario(const parameters& p, const std::string& chave, std::vector<bool>& gravados)
+{
+    std::ifstream arquivo(p.diario.c_str());
+    std::string linha;
+    int c;
+
+    if(p.diario.empty() || !std::getline(arquivo, linha) || linha != chave)
+        return false;
+    while(std::getline(arquivo, linha) && !arquivo.eof()){
+        c = atoi(linha.c_str());
+        if(c < 0) continue;
+        if(c >= (int) gravados.size()) gravados.resize(c + 1, false);
+        gravados[c] = true;
+    }
+    return true;
+}
+
 /*
 
 // This class coordinates the execution of jobs
@@ -221,49 +695,344 @@ public:
 class job_manager : public spitz::job_manager
 {
 private:
+    typedef std::pair<int, ListaTracos*> conjunto;
+
     parameters p;
-    int cdp;
+    //Posicoes em ordem, e nao os CDPs
+    int cdp, velocidade;
+    long tamanhoArquivo, modificacaoArquivo;
+    std::vector<int> ordem;
+    std::vector<bool> gravados;
+    //CDPs da tarefa atual, com a posicao de cada um no arquivo
+    std::vector<conjunto> lote;
+    //Sem fluxo somente os cabecalhos ficam em memoria, as amostras de um
+    //lote sao lidas deste arquivo quando ele e enviado
+    int arquivoAmostras;
+    //Na busca CRS, os vizinhos do CDP c sao indiceVizinhos[inicioVizinhos[c]]
+    //ate antes de inicioVizinhos[c+1], e os vizinhos do lote que nao estao
+    //nele sao enviados uma vez na tarefa
+    std::vector<long> inicioVizinhos;
+    int *indiceVizinhos;
+    std::vector<conjunto> vizinhos;
+
+    //Leitura em segundo plano, os CDPs completos vao para a fila
+    std::thread leitor;
+    std::mutex m;
+    std::condition_variable mudou;
+    std::deque<conjunto> fila;
+    bool fimLeitura, parar;
+    conjunto pendente;
+
+    // Longest-processing-time-first order. The cost of a CDP is its fold
+    // times ns times the number of velocities, replaced by the time
+    // measured on a previous run when the calibration file has it. CDPs
+    // missing from the file are scaled by the measured/estimated ratio.
+    void ordenar()
+    {
+        std::vector<double> modelo(p.tamanhoLista), custo(p.tamanhoLista, -1);
+        std::map<int, double> tempos;
+        std::map<int, double>::iterator it;
+        double medido = 0, estimado = 0, fator = 1;
+        int c, numero;
+        double tempo;
+
+        if(!p.calibracao.empty()){
+            std::ifstream arquivo(p.calibracao.c_str());
+            while(arquivo >> numero >> tempo)
+                tempos[numero] = tempo;
+        }
+
+        for(c=0; c<p.tamanhoLista; c++){
+            modelo[c] = (double) p.listaTracos[c]->tamanho * p.listaTracos[c]->tracos[0]->ns * p.VelocidadesAvaliadas();
+            it = tempos.find(p.listaTracos[c]->cdp);
+            if(it != tempos.end()){
+                custo[c] = it->second;
+                medido += it->second;
+                estimado += modelo[c];
+            }
+        }
+        if(medido > 0 && estimado > 0) fator = medido / estimado;
+        for(c=0; c<p.tamanhoLista; c++)
+            if(custo[c] < 0) custo[c] = modelo[c] * fator;
+
+        std::stable_sort(ordem.begin(), ordem.end(), [&custo](int a, int b){
+            return custo[a] > custo[b];
+        });
+        std::cout << p.who << "LPT order with " << tempos.size() << " calibrated CDPs, first CDP " << p.listaTracos[ordem[0]]->cdp << std::endl;
+    }
+
+    // Skips the CDPs already written by a previous run of the same job
+    void retomar()
+    {
+        ordem.erase(std::remove_if(ordem.begin(), ordem.end(), [this](int c){
+            return c < (int) gravados.size() && gravados[c];
+        }), ordem.end());
+        if((int) ordem.size() < p.tamanhoLista)
+            std::cout << p.who << "Resuming from " << p.diario << ", " << p.tamanhoLista - ordem.size() << " CDPs already written" << std::endl;
+    }
+
+    // Reads the gathers of a CDP-sorted file one at a time. The position of
+    // a CDP is its index in the file, the same the committer gets by
+    // sorting, and the queue is bounded to keep the memory in check.
+    void ler(LeitorSU arquivo)
+    {
+        ListaTracos *lista;
+        int c = 0, r;
+
+        while((r = ProximoCDPSU(&arquivo, &lista, p.aphLeitura(), p.azimuth)) == 1){
+            if(c < (int) gravados.size() && gravados[c]){
+                LiberarListaSU(lista);
+                c++;
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(m);
+            while(fila.size() >= (size_t) p.fluxo && !parar)
+                mudou.wait(lock);
+            if(parar){
+                LiberarListaSU(lista);
+                break;
+            }
+            fila.push_back(conjunto(c++, lista));
+            mudou.notify_all();
+        }
+        FecharLeitorSU(&arquivo);
+        if(r < 0){
+            std::cerr << "ERRO: --fluxo requer o arquivo ordenado por CDP " << p.arquivo << std::endl;
+            exit(1);
+        }
+        std::unique_lock<std::mutex> lock(m);
+        fimLeitura = true;
+        mudou.notify_all();
+        std::cout << p.who << "Finished reading " << c << " CDPs" << std::endl;
+    }
+
+    // Next CDP to go into a task, false when there are no more
+    bool proximo(conjunto& k)
+    {
+        if(pendente.second){
+            k = pendente;
+            pendente.second = NULL;
+            return true;
+        }
+        if(p.fluxo <= 0){
+            if(cdp >= (int) ordem.size()) return false;
+            k = conjunto(ordem[cdp], p.listaTracos[ordem[cdp]]);
+            cdp++;
+            return true;
+        }
+        std::unique_lock<std::mutex> lock(m);
+        while(fila.empty() && !fimLeitura)
+            mudou.wait(lock);
+        if(fila.empty()) return false;
+        k = fila.front();
+        fila.pop_front();
+        mudou.notify_all();
+        return true;
+    }
+
+    // Batch with K consecutive CDPs, or with CDPs up to the desired load.
+    // Gathers of a streamed file are freed once all of their tasks are out.
+    bool proximoLote()
+    {
+        conjunto k;
+        long bytes;
+        size_t i;
+
+        for(i=0; i<lote.size(); i++){
+            if(p.fluxo > 0) LiberarListaSU(lote[i].second);
+            else LiberarAmostrasSU(lote[i].second);
+        }
+        for(i=0; i<vizinhos.size(); i++)
+            LiberarAmostrasSU(vizinhos[i].second);
+        lote.clear();
+        vizinhos.clear();
+        if(!proximo(k)) return false;
+        lote.push_back(k);
+        bytes = tamanhoTarefa(k.second);
+        while(p.carga > 0 || (int) lote.size() < p.lote){
+            if(!proximo(k)) break;
+            if(p.carga > 0 && bytes + tamanhoTarefa(k.second) > p.carga){
+                pendente = k;
+                break;
+            }
+            bytes += tamanhoTarefa(k.second);
+            lote.push_back(k);
+        }
+        if(p.crs.md > 0)
+            agruparVizinhos();
+        if(p.fluxo <= 0 && !p.referencia)
+            materializar();
+        return true;
+    }
+
+    // Neighbors of the CDPs of the batch, each one once, that are not
+    // part of the batch themselves
+    void agruparVizinhos()
+    {
+        std::map<int, bool> enviados;
+        int vizinho;
+        size_t i;
+        long j;
+        for(i=0; i<lote.size(); i++)
+            enviados[lote[i].first] = true;
+        for(i=0; i<lote.size(); i++){
+            for(j=inicioVizinhos[lote[i].first]; j<inicioVizinhos[lote[i].first+1]; j++){
+                vizinho = indiceVizinhos[j];
+                if(enviados[vizinho]) continue;
+                enviados[vizinho] = true;
+                vizinhos.push_back(conjunto(vizinho, p.listaTracos[vizinho]));
+            }
+        }
+    }
+
+    // Reads the samples of the current batch and asks the system to read
+    // ahead the samples of the next CDPs in the order
+    void materializar()
+    {
+        size_t i;
+        int k;
+        for(i=0; i<lote.size()+vizinhos.size(); i++){
+            ListaTracos *lista = i < lote.size() ? lote[i].second : vizinhos[i-lote.size()].second;
+            if(!LerAmostrasSU(arquivoAmostras, lista)){
+                std::cerr << "ERRO NA LEITURA DO CDP " << lista->cdp << " " << p.arquivo << std::endl;
+                exit(1);
+            }
+        }
+        if(pendente.second)
+            AnteciparAmostrasSU(arquivoAmostras, pendente.second);
+        for(k=cdp; k<cdp+p.antecipacao && k<(int) ordem.size(); k++)
+            AnteciparAmostrasSU(arquivoAmostras, p.listaTracos[ordem[k]]);
+    }
 
 public:
     job_manager(int argc, const char *argv[], spitz::istream& jobinfo) :
-        p(argc, argv, "[JM] "), cdp(0)
+        p(argc, argv, "[JM] "), cdp(0), velocidade(0), arquivoAmostras(-1), indiceVizinhos(NULL), fimLeitura(false),
+        parar(false), pendente(0, NULL)
     {
-        //Leitura do arquivo
-        if(!LeitorArquivoSU(p.arquivo.c_str(), &(p.listaTracos), &p.tamanhoLista, p.aph, p.azimuth)){
+        LeitorSU arquivo;
+
+        if(!IdentidadeArquivoSU(p.arquivo.c_str(), &tamanhoArquivo, &modificacaoArquivo)){
+            std::cerr << "ERRO NA LEITURA " << p.arquivo.c_str() << std::endl;
+            std::cout << p.who << "ERRO NA LEITURA" << std::endl;
+            exit(1);
+        }
+        if(LerDiario(p, ChaveDiario(p), gravados) && p.fluxo > 0)
+            std::cout << p.who << "Resuming from " << p.diario << ", " << std::count(gravados.begin(), gravados.end(), true) << " CDPs already written" << std::endl;
+        if(p.fluxo > 0){
+            //Os CDPs sao enviados a medida que sao lidos
+            if(!AbrirLeitorSU(p.arquivo.c_str(), &arquivo)){
+                std::cerr << "ERRO NA LEITURA " << p.arquivo.c_str() << std::endl;
+                std::cout << p.who << "ERRO NA LEITURA" << std::endl;
+                exit(1);
+            }
+            if(p.lpt)
+                std::cout << p.who << "LPT order ignored when streaming" << std::endl;
+            leitor = std::thread(&job_manager::ler, this, arquivo);
+            std::cout << "[JM] Job manager created." << std::endl;
+            return;
+        }
+
+        //Leitura dos cabecalhos do arquivo. Os cabecalhos dos tracos dentro
+        //da aperture ficam em memoria, cerca de 280 bytes por traco, pois a
+        //selecao de cada busca, a ordem LPT e os vizinhos CRS dependem deles
+        if(!LeitorIndiceSU(p.arquivo.c_str(), &(p.listaTracos), &p.tamanhoLista, p.aphLeitura(), p.azimuth) ||
+            (arquivoAmostras = open(p.arquivo.c_str(), O_RDONLY)) < 0){
             std::cerr << "ERRO NA LEITURA " << p.arquivo.c_str() << std::endl;
             std::cout << p.who << "ERRO NA LEITURA" << std::endl;
             exit(1);
         }
+        for(int c=0; c<p.tamanhoLista; c++)
+            ordem.push_back(c);
+        if(p.crs.md > 0){
+            //Vizinhos pelo ponto medio projetado no azimute
+            inicioVizinhos.resize(p.tamanhoLista + 1);
+            indiceVizinhos = IndexarVizinhosSU(p.listaTracos, p.tamanhoLista, p.crs.md, p.azimuth, &inicioVizinhos[0]);
+            std::cout << p.who << "CRS supergathers with " << inicioVizinhos[p.tamanhoLista] << " neighbors" << std::endl;
+        }
+        if(p.lpt && p.continuidade > 0)
+            std::cout << p.who << "LPT order ignored by the guided search" << std::endl;
+        else if(p.lpt && p.tamanhoLista > 0)
+            ordenar();
+        retomar();
         std::cout << "[JM] Job manager created." << std::endl;
     }
 
-    bool next_task(const spitz::pusher& task)
+    // Size of the task payload of one CDP
+    long tamanhoTarefa(ListaTracos *lista)
     {
-        spitz::ostream o;
-        int i, j;
+        if(p.referencia) return 8 * (long) lista->tamanho;
+        return (long) lista->tamanho * (2 + 4*4 + sizeof(float) * lista->tracos[0]->ns);
+    }
 
-        if(cdp >= p.tamanhoLista){
-            return false;
+    // Header and traces of one CDP, or only their positions in the file
+    void enviar(spitz::ostream& o, int c, ListaTracos *lista)
+    {
+        int i, j;
+        o << c;
+        o << lista->cdp;
+        o << lista->tamanho;
+        o << lista->tracos[0]->dt;
+        o << lista->tracos[0]->ns;
+        o << p.referencia;
+        if(p.referencia){
+            //Somente a identidade do arquivo e a posicao de cada traco,
+            //o worker le as amostras do mesmo arquivo
+            o << (int64_t) tamanhoArquivo;
+            o << (int64_t) modificacaoArquivo;
+            for(i=0; i<lista->tamanho; i++)
+                o << (int64_t) lista->tracos[i]->posicao;
         }
+        else{
+            for(i=0; i<lista->tamanho; i++){
+                o << lista->tracos[i]->scalco;
+                o << lista->tracos[i]->sx;
+                o << lista->tracos[i]->sy;
+                o << lista->tracos[i]->gx;
+                o << lista->tracos[i]->gy;
+                for(j=0; j<lista->tracos[i]->ns; j++)
+                    o << lista->tracos[i]->dados[j];
+            }
+        }
+    }
 
-        o << cdp;
-        o << p.listaTracos[cdp]->cdp;
-        o << p.listaTracos[cdp]->tamanho;
-        o << p.listaTracos[cdp]->tracos[0]->dt;
-        o << p.listaTracos[cdp]->tracos[0]->ns;
-        for(i=0; i<p.listaTracos[cdp]->tamanho; i++){
-            o << p.listaTracos[cdp]->tracos[i]->scalco;
-            o << p.listaTracos[cdp]->tracos[i]->sx;
-            o << p.listaTracos[cdp]->tracos[i]->sy;
-            o << p.listaTracos[cdp]->tracos[i]->gx;
-            o << p.listaTracos[cdp]->tracos[i]->gy;
-            for(j=0; j<p.listaTracos[cdp]->tracos[i]->ns; j++)
-                o << p.listaTracos[cdp]->tracos[i]->dados[j];
+    bool next_task(const spitz::pusher& task)
+    {
+        spitz::ostream o;
+        int c, fim;
+        size_t k;
+        long j;
+
+        //Cada lote de CDPs e dividido em faixas de velocidades
+        if(velocidade >= p.VintMaximo() || lote.empty()){
+            velocidade = 0;
+            if(!proximoLote())
+                return false;
+        }
+        fim = velocidade + p.velocidades;
+        if(fim > p.VintMaximo()) fim = p.VintMaximo();
+
+        o << (int) lote.size();
+        o << velocidade;
+        o << fim;
+        for(k=0; k<lote.size(); k++)
+            enviar(o, lote[k].first, lote[k].second);
+        if(p.crs.md > 0){
+            //Os vizinhos fora do lote vao uma vez, seguidos da posicao dos
+            //vizinhos de cada CDP do lote
+            o << (int) vizinhos.size();
+            for(k=0; k<vizinhos.size(); k++)
+                enviar(o, vizinhos[k].first, vizinhos[k].second);
+            for(k=0; k<lote.size(); k++){
+                c = lote[k].first;
+                o << (int) (inicioVizinhos[c+1] - inicioVizinhos[c]);
+                for(j=inicioVizinhos[c]; j<inicioVizinhos[c+1]; j++)
+                    o << indiceVizinhos[j];
+            }
         }
 
-        std::cout << p.who << "Generated task for CDP: "<< cdp << "[" << p.listaTracos[cdp]->tamanho << "] (cdp= " << p.listaTracos[cdp]->cdp << ") de " << p.tamanhoLista << std::endl;
+        std::cout << p.who << "Generated task for CDPs: "<< lote[0].first << " (cdp= " << lote[0].second->cdp << ") e mais " << lote.size()-1 << " velocidades " << velocidade << " a " << fim << std::endl;
 
-        cdp += 1;
+        velocidade = fim;
 
         task.push(o);
         return true;
@@ -271,7 +1040,23 @@ public:
 
     ~job_manager()
     {
+        size_t i;
         std::cout << "[JM] Job manager destroyed." <<std::endl;
+        if(p.fluxo > 0){
+            {
+                std::unique_lock<std::mutex> lock(m);
+                parar = true;
+                mudou.notify_all();
+            }
+            leitor.join();
+            for(i=0; i<lote.size(); i++)
+                LiberarListaSU(lote[i].second);
+            for(i=0; i<fila.size(); i++)
+                LiberarListaSU(fila[i].second);
+            if(pendente.second) LiberarListaSU(pendente.second);
+        }
+        if(arquivoAmostras >= 0) close(arquivoAmostras);
+        free(indiceVizinhos);
         LiberarMemoria(&(p.listaTracos), &(p.tamanhoLista));
     }
 };
@@ -284,107 +1069,547 @@ class worker : public spitz::worker
 {
 private:
     parameters p;
-    TracosCDP **tracos;
-    int tamanho, namostras;
-    int cdp, ncdp;
+    const char *mapa;
+    long tamanhoMapa;
+    //Amostras da busca guiada resolvidas no corredor e na faixa inteira
+    long guiadas[2];
+
+    // One CDP of a task with its traces. The key of the result cache starts
+    // from the identity of the traces.
+    struct CDPTarefa
+    {
+        int c, cdp, tamanho;
+        short int dt, ns;
+        bool referencia;
+        TracosCDP **tracos;
+        uint64_t id;
+        // Half offset of each trace and projected midpoint at the azimuth
+        // of the search, computed once per task and shared by all the CRS
+        // supergathers that include the CDP
+        std::vector<float> h;
+        float m;
+    };
+
+    // Best velocity of each sample for one set of parameters
+    struct resultado
+    {
+        std::vector<float> pilhas, semblances, velocidades;
+        resultado(int ns) : pilhas(ns), semblances(ns), velocidades(ns) {}
+    };
 
-public:
-    worker(int argc, const char *argv[]) : p(argc, argv, "[WK] ")
+    // Maps the input file on the first task sent by reference and checks
+    // that it is the same file seen by the job manager
+    bool mapear(int64_t tamanhoArquivo, int64_t modificacaoArquivo)
     {
-        //p.print();
-        std::cout << "[WK] Worker created." << argc << std::endl;
+        long tamanho, modificacao;
+
+        if(!IdentidadeArquivoSU(p.arquivo.c_str(), &tamanho, &modificacao) ||
+            tamanho != tamanhoArquivo || modificacao != modificacaoArquivo){
+            std::cerr << p.who << "ARQUIVO DIFERENTE DO JOB MANAGER " << p.arquivo << std::endl;
+            return false;
+        }
+        if(mapa == NULL)
+            mapa = MapearArquivoSU(p.arquivo.c_str(), &tamanhoMapa);
+        if(mapa == NULL){
+            std::cerr << p.who << "ERRO NO MAPEAMENTO " << p.arquivo << std::endl;
+            return false;
+        }
+        return true;
     }
 
-    int run(spitz::istream& task, const spitz::pusher& result)
+    // Reads one CDP of the task, with the traces or their positions in the
+    // mapped input file
+    bool ler(spitz::istream& task, CDPTarefa& g)
     {
-        spitz::ostream o;
-        int amostra, batch;
-        int i, total, a;
-        float *Vvector, *Cvector;
-        float seg, t0, Vinc, s, bestS, bestV, pilha, pilhaTemp;
-        short int dt, ns;
-        int w;
-        int j;
-        
-        //Calculo de V e C para a busca
-        Vinc = (p.Vfin-p.Vini)/(p.Vint);
-        Vvector = (float*) malloc(sizeof(float)*(p.Vint));
-        Cvector = (float*) malloc(sizeof(float)*(p.Vint));
-        for(i=0; i<p.Vint; i++){
-            Vvector[i] = Vinc*i+p.Vini;
-            Cvector[i] = 4/Vvector[i]*1/Vvector[i];
+        int i, j;
+        int64_t tamanhoArquivo, modificacaoArquivo, posicao;
+
+        g.tracos = NULL;
+        task >> g.c;
+        task >> g.cdp;
+        task >> g.tamanho;
+        task >> g.dt;
+        task >> g.ns;
+        task >> g.referencia;
+        if(g.referencia){
+            task >> tamanhoArquivo;
+            task >> modificacaoArquivo;
+            if(!mapear(tamanhoArquivo, modificacaoArquivo))
+                return false;
         }
 
-        task >> ncdp;
-        task >> cdp;
-        task >> tamanho;
-        task >> dt;
-        task >> ns;
+        //Chave da cache de resultados, o conteudo dos tracos entra a
+        //medida que eles sao lidos e os parametros de cada busca no fim
+        int chave[] = { VERSAO_RESULTADOS, g.tamanho, g.dt, g.ns, g.referencia };
+        g.id = HashFNV(chave, sizeof(chave));
+        if(g.referencia){
+            g.id = HashFNV(&tamanhoArquivo, sizeof(tamanhoArquivo), g.id);
+            g.id = HashFNV(&modificacaoArquivo, sizeof(modificacaoArquivo), g.id);
+        }
 
-        //Tempo entre amostras, convertido para segundos
-        seg = ((float) dt)/1000000;
-        tracos = (TracosCDP**) malloc(sizeof(TracosCDP*)*tamanho);
-
-        for(i=0; i<tamanho; i++){
-            tracos[i] = (TracosCDP*) malloc(sizeof(TracosCDP));
-            task >> tracos[i]->scalco;
-            task >> tracos[i]->sx;
-            task >> tracos[i]->sy;
-            task >> tracos[i]->gx;
-            task >> tracos[i]->gy;
-            tracos[i]->ns = ns;
-            tracos[i]->dados = (float*) malloc(sizeof(float)*ns);
-            for(j=0; j<ns; j++)
-                task >> tracos[i]->dados[j];
+        g.tracos = (TracosCDP**) calloc(g.tamanho, sizeof(TracosCDP*));
+        for(i=0; i<g.tamanho; i++){
+            g.tracos[i] = (TracosCDP*) malloc(sizeof(TracosCDP));
+            if(g.referencia){
+                //Leitura do traco direto do arquivo mapeado
+                task >> posicao;
+                if(!LeitorTracoMapeadoSU(mapa, tamanhoMapa, posicao, g.tracos[i])){
+                    std::cerr << p.who << "TRACO FORA DO ARQUIVO " << posicao << std::endl;
+                    exit(1);
+                }
+                g.id = HashFNV(&posicao, sizeof(posicao), g.id);
+                continue;
+            }
+            task >> g.tracos[i]->scalco;
+            task >> g.tracos[i]->sx;
+            task >> g.tracos[i]->sy;
+            task >> g.tracos[i]->gx;
+            task >> g.tracos[i]->gy;
+            g.tracos[i]->ns = g.ns;
+            g.tracos[i]->dados = (float*) malloc(sizeof(float)*g.ns);
+            for(j=0; j<g.ns; j++)
+                task >> g.tracos[i]->dados[j];
+            g.id = HashFNV(&(g.tracos[i]->scalco), sizeof(g.tracos[i]->scalco), g.id);
+            g.id = HashFNV(&(g.tracos[i]->sx), sizeof(g.tracos[i]->sx), g.id);
+            g.id = HashFNV(&(g.tracos[i]->sy), sizeof(g.tracos[i]->sy), g.id);
+            g.id = HashFNV(&(g.tracos[i]->gx), sizeof(g.tracos[i]->gx), g.id);
+            g.id = HashFNV(&(g.tracos[i]->gy), sizeof(g.tracos[i]->gy), g.id);
+            g.id = HashFNV(g.tracos[i]->dados, sizeof(float)*g.ns, g.id);
+        }
+        return true;
+    }
+
+    //Liberar memoria alocada para o CDP
+    void liberar(CDPTarefa& g)
+    {
+        int i;
+        for(i=0; i<g.tamanho && g.tracos; i++){
+            if(!g.tracos[i]) continue;
+            free(g.tracos[i]->dados);
+            free(g.tracos[i]);
+        }
+        free(g.tracos);
+        g.tracos = NULL;
+    }
+
+    // Searches the velocities of a group of sets of parameters with the
+    // same list of velocities. Each sample of a trace is visited once for
+    // all sets, the time of the trace once for the sets of each azimuth.
+    // With the results of the previous CDP as a guide, each sample is first
+    // searched within the tolerance of the previous velocity, and again over
+    // the whole range when the previous pick is not confident or the best
+    // velocity is on the edge of the corridor.
+    void buscar(const CDPTarefa& g, const std::vector<size_t>& grupo, const std::vector<std::vector<float> >& h,
+        int vinicio, int vfim, const std::vector<float>& Vvector, const std::vector<float>& Cvector,
+        float seg, std::vector<resultado>& resultados, const std::vector<resultado> *guia = NULL)
+    {
+        int i, a, de, ate, centro;
+        size_t q, n = grupo.size(), na = p.azimutes.size();
+        float t0, Vinc;
+        bool refazer;
+        std::vector<const float*> hs(n);
+        std::vector<int> primeiros(n, -1), larguras(n), inicios(n), fins(n), melhores(n);
+        std::vector<float> janelas(n), aberturas(n), s(n), pilhaTemp(n), bestS(n), bestV(n), pilha(n);
+        std::vector<size_t> ativas;
+
+        //Uma busca sem tracos dentro da aperture fica com pilha, semblance
+        //e velocidade 0, e as outras sao avaliadas sem ela
+        for(q=0; q<n; q++){
+            for(i=0; i<g.tamanho; i++)
+                if(fabs(h[grupo[q] % na][i]) < p.buscas[grupo[q]].aph) break;
+            if(i < g.tamanho) ativas.push_back(grupo[q]);
+            else{
+                std::fill(resultados[grupo[q]].pilhas.begin(), resultados[grupo[q]].pilhas.end(), 0);
+                std::fill(resultados[grupo[q]].semblances.begin(), resultados[grupo[q]].semblances.end(), 0);
+                std::fill(resultados[grupo[q]].velocidades.begin(), resultados[grupo[q]].velocidades.end(), 0);
+            }
+        }
+        if(ativas.size() < n){
+            if(!ativas.empty())
+                buscar(g, ativas, h, vinicio, vfim, Vvector, Cvector, seg, resultados, guia);
+            return;
         }
-        std::cout << "WORKING ON CDP " << cdp << std::endl;
 
-        o << ncdp;
-        o << cdp;
-        for(a=0; a<ns; a++){
+        for(q=0; q<n; q++){
+            const busca& b = p.buscas[grupo[q]];
+            janelas[q] = b.wind;
+            aberturas[q] = b.aph;
+            hs[q] = &h[grupo[q] % na][0];
+            //Primeiro traco dentro da aperture, o valor inicial da pilha
+            for(i=0; i<g.tamanho && primeiros[q] < 0; i++)
+                if(fabs(hs[q][i]) < aberturas[q]) primeiros[q] = i;
+            //Velocidades de cada lado da velocidade do CDP anterior
+            larguras[q] = (int) ceil(p.continuidade / ((b.Vfin-b.Vini)/(b.Vint)));
+        }
+
+        //Avalia as velocidades de de ate ate, cada busca somente na sua faixa
+        auto varrer = [&](int de, int ate){
+            for(int i=de; i<ate; i++){
+                //Calcular semblance de todas as buscas
+                SemblanceJanelas(g.tracos,g.tamanho,&hs[0],&aberturas[0],Cvector[i],t0,&janelas[0],n,seg,&s[0],&pilhaTemp[0]);
+                for(size_t q=0; q<n; q++){
+                    if(s[q]<0 && s[q]!=-1) {printf("S NEGATIVO\n"); exit(1);}
+                    if(s[q]>1) {printf("S MAIOR Q UM %.20f\n", s[q]); exit(1);}
+                    else if(s[q] > bestS[q] && i >= inicios[q] && i < fins[q]){
+                        bestS[q] = s[q];
+                        bestV[q] = Vvector[i];
+                        pilha[q] = pilhaTemp[q];
+                        melhores[q] = i;
+                    }
+                }
+            }
+        };
+
+        for(a=0; a<g.ns; a++){
             //Calcula o segundo inicial
             t0 = a*seg;
 
             //Inicializar variaveis antes da busca
-            pilha = tracos[0]->dados[a];
-            bestS = 0.0;
-            bestV = 0.0;
+            de = vfim;
+            ate = vinicio;
+            for(q=0; q<n; q++){
+                pilha[q] = g.tracos[primeiros[q]]->dados[a];
+                bestS[q] = 0.0;
+                bestV[q] = 0.0;
+                melhores[q] = -1;
+                inicios[q] = vinicio;
+                fins[q] = vfim;
+                const resultado *anterior = guia ? &(*guia)[grupo[q]] : NULL;
+                if(anterior && anterior->semblances[a] > p.limiarContinuidade && anterior->velocidades[a] != 0){
+                    const busca& b = p.buscas[grupo[q]];
+                    Vinc = (b.Vfin-b.Vini)/(b.Vint);
+                    centro = (int) lround((anterior->velocidades[a] - b.Vini) / Vinc);
+                    inicios[q] = std::max(vinicio, centro - larguras[q]);
+                    fins[q] = std::min(vfim, centro + larguras[q] + 1);
+                }
+                de = std::min(de, inicios[q]);
+                ate = std::max(ate, fins[q]);
+            }
+
+            //Para cada velocidade da faixa
+            varrer(de, ate);
+
+            //Sem confianca no corredor, abaixo do limiar ou de metade do
+            //semblance do CDP anterior, a busca volta a faixa inteira
+            refazer = false;
+            for(q=0; q<n; q++){
+                if(inicios[q] == vinicio && fins[q] == vfim){
+                    inicios[q] = fins[q] = vinicio;
+                    if(guia) guiadas[1]++;
+                }
+                else if(bestS[q] <= p.limiarContinuidade || bestS[q] < (*guia)[grupo[q]].semblances[a] / 2 ||
+                    (melhores[q] == inicios[q] && inicios[q] > vinicio) ||
+                    (melhores[q] == fins[q] - 1 && fins[q] < vfim)){
+                    pilha[q] = g.tracos[primeiros[q]]->dados[a];
+                    bestS[q] = 0.0;
+                    bestV[q] = 0.0;
+                    inicios[q] = vinicio;
+                    fins[q] = vfim;
+                    refazer = true;
+                    guiadas[1]++;
+                }
+                else{
+                    inicios[q] = fins[q] = vinicio;
+                    guiadas[0]++;
+                }
+            }
+            if(refazer)
+                varrer(vinicio, vfim);
+
+            for(q=0; q<n; q++){
+                resultados[grupo[q]].pilhas[a] = pilha[q];
+                resultados[grupo[q]].semblances[a] = bestS[q];
+                resultados[grupo[q]].velocidades[a] = bestV[q];
+            }
+        }
+    }
+
+    // Appends the result of each search for one CDP. The gather and the
+    // half-offset of its traces in each azimuth are shared by all sets, a
+    // search is skipped when the range is past its velocities or when none
+    // of the traces is inside its aperture. In the guided search, anterior
+    // has the results of the previous CDP of the task and gets these ones.
+    void executar(const CDPTarefa& g, spitz::ostream& o,
+        const std::vector<std::vector<float> >& Vvector,
+        const std::vector<std::vector<float> >& Cvector, int vinicio, int vfim,
+        std::vector<resultado> *anterior = NULL)
+    {
+        int i, a;
+        size_t k, l, nb = p.buscas.size(), na = p.azimutes.size();
+        float seg, tempo;
+        std::chrono::steady_clock::time_point inicio;
+
+        std::cout << "WORKING ON CDP " << g.cdp << std::endl;
 
-            //Para cada velocidade
-            for(i=0; i<p.Vint; i++){
+        //Tempo entre amostras, convertido para segundos
+        seg = ((float) g.dt)/1000000;
+
+        //Metade do offset de cada traco em cada azimute, a mesma para
+        //todas as buscas do azimute
+        std::vector<std::vector<float> > h(na, std::vector<float>(g.tamanho));
+        for(k=0; k<na; k++)
+            for(i=0; i<g.tamanho; i++)
+                h[k][i] = HalfOffsetWorker(g.tracos[i], p.azimutes[k]);
+
+        std::vector<resultado> resultados(nb, resultado(g.ns));
+        std::vector<int> fim(nb);
+        std::vector<uint64_t> ids(nb);
+        std::vector<bool> avaliada(nb), pronta(nb);
+
+        inicio = std::chrono::steady_clock::now();
+        for(k=0; k<nb; k++){
+            fim[k] = std::min(vfim, (int) p.buscas[k].Vint);
+            avaliada[k] = false;
+            for(i=0; i<g.tamanho && vinicio < fim[k] && !avaliada[k]; i++)
+                avaliada[k] = fabs(h[k % na][i]) < p.buscas[k].aph;
+            int faixa[] = { vinicio, fim[k] };
+            ids[k] = HashFNV(faixa, sizeof(faixa), g.id);
+            ids[k] = HashFNV(&p.buscas[k], sizeof(busca), ids[k]);
+            pronta[k] = !avaliada[k] || (!p.resultados.empty() &&
+                cache_resultados::instancia().buscar(p.resultados, ids[k], g.ns, &resultados[k].pilhas[0],
+                &resultados[k].semblances[0], &resultados[k].velocidades[0]));
+        }
+        for(k=0; k<nb; k++){
+            if(pronta[k]) continue;
+            //Buscas com as mesmas velocidades sao avaliadas juntas
+            std::vector<size_t> grupo;
+            for(l=k; l<nb; l++){
+                if(!pronta[l] && p.buscas[l].Vini == p.buscas[k].Vini && p.buscas[l].Vfin == p.buscas[k].Vfin &&
+                    p.buscas[l].Vint == p.buscas[k].Vint)
+                    grupo.push_back(l);
+            }
+            buscar(g, grupo, h, vinicio, fim[k], Vvector[k], Cvector[k], seg, resultados,
+                anterior && !anterior->empty() ? anterior : NULL);
+            for(l=0; l<grupo.size(); l++){
+                pronta[grupo[l]] = true;
+                if(!p.resultados.empty())
+                    cache_resultados::instancia().inserir(p.resultados, ids[grupo[l]], g.ns, &resultados[grupo[l]].pilhas[0],
+                        &resultados[grupo[l]].semblances[0], &resultados[grupo[l]].velocidades[0], p.limiteResultados);
+            }
+        }
+        //Tempo gasto no CDP, usado para calibrar a ordem das tarefas
+        tempo = std::chrono::duration<float>(std::chrono::steady_clock::now() - inicio).count();
+        if(anterior) *anterior = resultados;
+
+        o << g.c;
+        o << g.cdp;
+        o << tempo;
+        for(k=0; k<nb; k++){
+            o << (bool) avaliada[k];
+            for(a=0; a<g.ns && avaliada[k]; a++){
+                o << resultados[k].pilhas[a];
+                o << resultados[k].semblances[a];
+                o << resultados[k].velocidades[a];
+            }
+        }
+    }
+
+    // Computes the geometry of a CDP used by the CRS supergathers
+    void geometria(CDPTarefa& g)
+    {
+        int i;
+        g.h.resize(g.tamanho);
+        for(i=0; i<g.tamanho; i++)
+            g.h[i] = HalfOffsetWorker(g.tracos[i], p.azimuth);
+        g.m = MidpointWorker(g.tracos[0], p.azimuth);
+    }
+
+    // Common-reflection-surface search of one CDP. The velocity comes from
+    // the CMP search of the CDP alone, then A and B are searched one after
+    // the other over the supergather, with the other attributes fixed.
+    // Samples below the threshold keep the CMP result with A=B=0.
+    void executarCRS(const CDPTarefa& g, const std::vector<const CDPTarefa*>& vizinhos, spitz::ostream& o,
+        const std::vector<float>& Vvector, const std::vector<float>& Cvector)
+    {
+        int i, a;
+        size_t v;
+        float seg, tempo, t0, C, s, pilhaTemp;
+        float Ainc, Binc, melhorS, melhorA, melhorB, melhorPilha;
+        const busca& b = p.buscas[0];
+        std::chrono::steady_clock::time_point inicio;
+        std::vector<TracosCDP*> tracos;
+        std::vector<float> h, md;
+        std::vector<int> inicios;
+        std::vector<resultado> resultados(1, resultado(g.ns));
+
+        std::cout << "WORKING ON CDP " << g.cdp << " (CRS, " << vizinhos.size() << " neighbors)" << std::endl;
+
+        //Tempo entre amostras, convertido para segundos
+        seg = ((float) g.dt)/1000000;
+        inicio = std::chrono::steady_clock::now();
+
+        //Supergather com os tracos do CDP e dos vizinhos, com a metade do
+        //offset de cada traco e o deslocamento do ponto medio de cada CDP
+        for(v=0; v<=vizinhos.size(); v++){
+            const CDPTarefa& u = v == 0 ? g : *vizinhos[v-1];
+            md.push_back(v == 0 ? 0 : u.m - g.m);
+            inicios.push_back(tracos.size());
+            tracos.insert(tracos.end(), u.tracos, u.tracos + u.tamanho);
+            h.insert(h.end(), u.h.begin(), u.h.end());
+        }
+        inicios.push_back(tracos.size());
+
+        //Velocidade pela busca CMP do CDP
+        std::vector<std::vector<float> > hCDP(1, g.h);
+        buscar(g, std::vector<size_t>(1, 0), hCDP, 0, (int) b.Vint, Vvector, Cvector, seg, resultados);
+
+        Ainc = (p.crs.Afin-p.crs.Aini)/(p.crs.Aint);
+        Binc = (p.crs.Bfin-p.crs.Bini)/(p.crs.Bint);
+        o << g.c;
+        o << g.cdp;
+        std::vector<float> As(g.ns, 0), Bs(g.ns, 0);
+        for(a=0; a<g.ns; a++){
+            if(resultados[0].semblances[a] <= p.crs.limiar || resultados[0].velocidades[a] == 0)
+                continue;
+            t0 = a*seg;
+            C = 4/resultados[0].velocidades[a]*1/resultados[0].velocidades[a];
+
+            //A=0 e B=0 no supergather e o ponto de partida. Sem tracos na
+            //janela o semblance parte de 0, como em buscar, com a pilha CMP
+            pilhaTemp = 0;
+            melhorS = SemblanceCRS(&tracos[0],&h[0],&md[0],&inicios[0],inicios.size()-1,0,0,C,t0,b.wind,seg,&pilhaTemp);
+            melhorPilha = pilhaTemp;
+            if(!(melhorS > 0)){
+                melhorS = 0;
+                melhorPilha = resultados[0].pilhas[a];
+            }
+            melhorA = 0;
+            melhorB = 0;
+            for(i=0; i<p.crs.Aint; i++){
+                pilhaTemp = 0;
+                s = SemblanceCRS(&tracos[0],&h[0],&md[0],&inicios[0],inicios.size()-1,Ainc*i+p.crs.Aini,0,C,t0,b.wind,seg,&pilhaTemp);
+                if(s > melhorS){
+                    melhorS = s;
+                    melhorA = Ainc*i+p.crs.Aini;
+                    melhorPilha = pilhaTemp;
+                }
+            }
+            for(i=0; i<p.crs.Bint; i++){
                 pilhaTemp = 0;
-                //Calcular semblance
-                s = SemblanceWorker(tracos,tamanho,0.0,0.0,Cvector[i],t0,p.wind,seg,&pilhaTemp,p.azimuth);
-                if(s<0 && s!=-1) {printf("S NEGATIVO\n"); exit(1);}
-                if(s>1) {printf("S MAIOR Q UM %.20f\n", s); exit(1);}
-                else if(s > bestS){
-                    bestS = s;
-                    bestV = Vvector[i];
-                    pilha = pilhaTemp;
+                s = SemblanceCRS(&tracos[0],&h[0],&md[0],&inicios[0],inicios.size()-1,melhorA,Binc*i+p.crs.Bini,C,t0,b.wind,seg,&pilhaTemp);
+                if(s > melhorS){
+                    melhorS = s;
+                    melhorB = Binc*i+p.crs.Bini;
+                    melhorPilha = pilhaTemp;
                 }
             }
+            resultados[0].pilhas[a] = melhorPilha;
+            resultados[0].semblances[a] = melhorS;
+            As[a] = melhorA;
+            Bs[a] = melhorB;
+        }
+        //Tempo gasto no CDP, usado para calibrar a ordem das tarefas
+        tempo = std::chrono::duration<float>(std::chrono::steady_clock::now() - inicio).count();
+
+        o << tempo;
+        o << true;
+        for(a=0; a<g.ns; a++){
+            o << resultados[0].pilhas[a];
+            o << resultados[0].semblances[a];
+            o << resultados[0].velocidades[a];
+            o << As[a];
+            o << Bs[a];
+        }
+    }
+
+public:
+    worker(int argc, const char *argv[]) : p(argc, argv, "[WK] "),
+        mapa(NULL), tamanhoMapa(0)
+    {
+        guiadas[0] = guiadas[1] = 0;
+        if(!p.resultados.empty())
+            cache_resultados::instancia().entrar();
+        //p.print();
+        std::cout << "[WK] Worker created." << argc << std::endl;
+    }
 
-            o << pilha;
-            o << bestS;
-            o << bestV;
+    int run(spitz::istream& task, const spitz::pusher& result)
+    {
+        spitz::ostream o;
+        int i, j, n, m, c, lote;
+        size_t k;
+        float Vinc;
+        int vinicio, vfim;
+        bool ok = true;
+        std::vector<std::vector<float> > Vvector(p.buscas.size()), Cvector(p.buscas.size());
+
+        //Calculo de V e C de cada busca, uma vez para todo o lote
+        for(k=0; k<p.buscas.size(); k++){
+            const busca& b = p.buscas[k];
+            Vinc = (b.Vfin-b.Vini)/(b.Vint);
+            for(i=0; i<b.Vint; i++){
+                Vvector[k].push_back(Vinc*i+b.Vini);
+                Cvector[k].push_back(4/Vvector[k][i]*1/Vvector[k][i]);
+            }
         }
-        result.push(o);
 
-        free(Vvector);
-        free(Cvector);
+        //Quantidade de CDPs e faixa de velocidades avaliadas
+        task >> lote;
+        task >> vinicio;
+        task >> vfim;
+
+        //Os resultados de todos os CDPs vao juntos
+        if(p.crs.md <= 0){
+            //Na busca guiada cada CDP parte dos resultados do anterior
+            std::vector<resultado> anterior;
+            for(n=0; n<lote && ok; n++){
+                CDPTarefa g;
+                ok = ler(task, g);
+                if(ok) executar(g, o, Vvector, Cvector, vinicio, vfim, p.continuidade > 0 ? &anterior : NULL);
+                liberar(g);
+            }
+        }
+        else{
+            //Os CDPs do lote, os vizinhos que nao estao no lote e a posicao
+            //dos vizinhos de cada CDP do lote
+            std::vector<CDPTarefa> gathers(lote);
+            std::map<int, const CDPTarefa*> posicoes;
+            std::map<int, const CDPTarefa*>::iterator it;
+            m = 0;
+            for(n=0; n<lote && ok; n++)
+                ok = ler(task, gathers[n]);
+            if(ok) task >> m;
+            for(n=0; n<m && ok; n++){
+                gathers.push_back(CDPTarefa());
+                ok = ler(task, gathers.back());
+            }
+            for(k=0; k<gathers.size() && ok; k++){
+                posicoes[gathers[k].c] = &gathers[k];
+                geometria(gathers[k]);
+            }
+            for(n=0; n<lote && ok; n++){
+                std::vector<const CDPTarefa*> vizinhos;
+                task >> m;
+                for(j=0; j<m && ok; j++){
+                    task >> c;
+                    //Um vizinho que nao veio na tarefa invalida a tarefa
+                    if((it = posicoes.find(c)) == posicoes.end()){
+                        std::cerr << "[WK] Neighbor " << c << " missing from the task" << std::endl;
+                        ok = false;
+                    }
+                    else vizinhos.push_back(it->second);
+                }
+                if(ok) executarCRS(gathers[n], vizinhos, o, Vvector[0], Cvector[0]);
+            }
+            for(k=0; k<gathers.size(); k++)
+                liberar(gathers[k]);
+        }
+        if(ok) result.push(o);
 
-        return 0;
+        return ok ? 0 : 1;
     }
 
     ~worker()
     {
-        int i, j;
-        for(i=0; i<tamanho; i++){
-            for(j=0; j<namostras; j++)
-                free(tracos[i]->dados);
-            free(tracos[i]);
+        long acertos, faltas, descartes;
+        if(!p.resultados.empty() && cache_resultados::instancia().sair()){
+            cache_resultados::instancia().estatisticas(&acertos, &faltas, &descartes);
+            std::cout << "[WK] Result cache of all workers: " << acertos << " hits, " << faltas << " misses, " << descartes << " evictions." << std::endl;
         }
-        free(tracos);
+        if(p.continuidade > 0)
+            std::cout << "[WK] Guided search: " << guiadas[0] << " samples in the corridor, " << guiadas[1] << " over the whole range." << std::endl;
+        DesmapearArquivoSU(mapa, tamanhoMapa);
+        std::cout << "[WK] Worker destroyed." << std::endl;
     }
 };
 
@@ -395,29 +1620,260 @@ class committer : public spitz::committer
 {
 private:
     parameters p;
-    float **semblance, **empilhado, **velocidade;
+    //Resultados de cada CDP e busca, na posicao c*buscas+k, e os
+    //atributos A e B da busca CRS
+    float **semblance, **empilhado, **velocidade, **atributoA, **atributoB;
     int cdp, ns, cdps, ncdp;
+    size_t nb, componentes;
+    std::vector<double> tempos;
+    std::vector<int> recebidas;
+    std::vector<bool> gravados;
+    std::vector<int> numeros;
+    //Posicao de cada CDP na saida de cada busca, -1 quando ele nao tem
+    //tracos dentro da aperture da busca, e o cabecalho do traco de saida
+    std::vector<int> posicoes, totais;
+    std::vector<Traco> cabecalhos;
+    std::string chave;
+    //Empilhado, semblance e V de cada busca, e A e B na busca CRS
+    std::vector<std::string> saidas;
+    std::vector<int> arquivos;
+    int arquivoDiario;
+    //CDPs gravados desde a ultima sincronizacao do diario
+    std::string pendentes;
+    int quantidadePendentes;
+    std::chrono::steady_clock::time_point sincronizado;
+
+    // The files are not truncated because several committers of the same
+    // job may write to them, every slot is rewritten and commit_job cuts
+    // what is left of a previous output
+    int abrir(const std::string& nome)
+    {
+        int fd = open(nome.c_str(), O_WRONLY | O_CREAT, 0644);
+        if(fd < 0){
+            std::cerr << "ERRO NA ESCRITA " << nome << std::endl;
+            exit(1);
+        }
+        return fd;
+    }
+
+    // The output of a set of parameters has the CDPs with a trace inside
+    // its aperture, in CDP order. The header of the output traces comes
+    // from the first trace of the CDP in the file inside the aperture.
+    void indexar()
+    {
+        int c, i, primeiro;
+        size_t k;
+        ListaTracos *lista;
+
+        posicoes.assign(cdps * nb, -1);
+        cabecalhos.resize(cdps * nb);
+        totais.assign(nb, 0);
+        for(c=0; c<cdps; c++){
+            lista = p.listaTracos[c];
+            numeros.push_back(lista->cdp);
+            for(k=0; k<nb; k++){
+                primeiro = -1;
+                for(i=0; i<lista->tamanho; i++){
+                    if(fabs(HalfOffset(lista->tracos[i], p.buscas[k].azimuth)) < p.buscas[k].aph &&
+                        (primeiro < 0 || lista->tracos[i]->posicao < lista->tracos[primeiro]->posicao))
+                        primeiro = i;
+                }
+                if(primeiro < 0) continue;
+                posicoes[c*nb+k] = totais[k]++;
+                memcpy(&cabecalhos[c*nb+k], lista->tracos[primeiro], SEISMIC_UNIX_HEADER);
+            }
+        }
+    }
+
+    // Each CDP has a fixed slot in the output files, so it can be written as
+    // soon as all of its velocity ranges arrive, in any order
+    void gravar(int fd, int c, const Traco& cabecalho, const float *dados)
+    {
+        std::vector<char> registro(SEISMIC_UNIX_HEADER + sizeof(float) * ns);
+        off_t posicao = (off_t) c * registro.size();
+        memcpy(&registro[0], &cabecalho, SEISMIC_UNIX_HEADER);
+        memcpy(&registro[SEISMIC_UNIX_HEADER], dados, sizeof(float) * ns);
+        if(pwrite(fd, &registro[0], registro.size(), posicao) != (ssize_t) registro.size()){
+            std::cerr << "ERRO NA ESCRITA DO CDP " << c << std::endl;
+            exit(1);
+        }
+    }
+
+    // The journal lines are group-committed: every few CDPs or seconds the
+    // output files are synced, and only then the lines of the CDPs written
+    // since the last time are appended in one write and synced, so a CDP in
+    // the journal survives the death of the process or of the machine
+    void sincronizarDiario()
+    {
+        size_t k;
+        if(arquivoDiario < 0 || pendentes.empty()) return;
+        //As saidas sao escritas com pwrite, sem buffer a esvaziar
+        for(k=0; k<arquivos.size(); k++){
+            if(arquivos[k] >= 0 && fsync(arquivos[k]) != 0){
+                std::cerr << "ERRO NA ESCRITA DOS ARQUIVOS DE SAIDA" << std::endl;
+                exit(1);
+            }
+        }
+        if(write(arquivoDiario, pendentes.c_str(), pendentes.size()) != (ssize_t) pendentes.size() ||
+            fsync(arquivoDiario) != 0){
+            std::cerr << "ERRO NA ESCRITA " << p.diario << std::endl;
+            exit(1);
+        }
+        pendentes.clear();
+        quantidadePendentes = 0;
+        sincronizado = std::chrono::steady_clock::now();
+    }
+
+    void gravar(int c)
+    {
+        Traco tracoSemblance, tracoEmpilhado, tracoV;
+        size_t k, r;
+
+        for(k=0; k<nb; k++){
+            r = c*nb+k;
+            if(posicoes[r] < 0) continue;
+            if(!semblance[r]){
+                std::cerr << "[CO] CDP " << c << " has no result for parameter set " << k << "!" << std::endl;
+                exit(1);
+            }
+            memcpy(&tracoEmpilhado,&cabecalhos[r], SEISMIC_UNIX_HEADER);
+            SetCabecalhoCMP(&tracoEmpilhado);
+            memcpy(&tracoSemblance,&tracoEmpilhado, SEISMIC_UNIX_HEADER);
+            memcpy(&tracoV,&tracoEmpilhado, SEISMIC_UNIX_HEADER);
+
+            gravar(arquivos[componentes*k], posicoes[r], tracoEmpilhado, empilhado[r]);
+            gravar(arquivos[componentes*k+1], posicoes[r], tracoSemblance, semblance[r]);
+            gravar(arquivos[componentes*k+2], posicoes[r], tracoV, velocidade[r]);
+            if(atributoA){
+                gravar(arquivos[componentes*k+3], posicoes[r], tracoV, atributoA[r]);
+                gravar(arquivos[componentes*k+4], posicoes[r], tracoV, atributoB[r]);
+            }
+        }
+        gravados[c] = true;
+
+        if(arquivoDiario >= 0){
+            pendentes += std::to_string(c) + "\n";
+            if(++quantidadePendentes >= DIARIO_CDPS ||
+                std::chrono::steady_clock::now() - sincronizado >= std::chrono::seconds(DIARIO_SEGUNDOS))
+                sincronizarDiario();
+        }
+
+        liberar(c);
+    }
+
+    void liberar(int c)
+    {
+        size_t k;
+        for(k=c*nb; k<(c+1)*nb; k++){
+            free(semblance[k]);
+            free(empilhado[k]);
+            free(velocidade[k]);
+            semblance[k] = empilhado[k] = velocidade[k] = NULL;
+            if(atributoA){
+                free(atributoA[k]);
+                free(atributoB[k]);
+                atributoA[k] = atributoB[k] = NULL;
+            }
+        }
+    }
+
+    // Keeps the best of a range of velocities for each sample of the CDP
+    void acumular(int c, size_t k, float e, float s, float v, int i, float A = 0, float B = 0)
+    {
+        int j;
+        size_t r = c*nb+k;
+        float Vini = p.buscas[k].Vini;
+        if(!semblance[r]){
+            semblance[r] = (float*) calloc(ns, sizeof(float));
+            empilhado[r] = (float*) calloc(ns, sizeof(float));
+            velocidade[r] = (float*) calloc(ns, sizeof(float));
+            if(atributoA){
+                atributoA[r] = (float*) calloc(ns, sizeof(float));
+                atributoB[r] = (float*) calloc(ns, sizeof(float));
+            }
+            //Qualquer resultado parcial substitui o valor inicial
+            for(j=0; j<ns; j++)
+                semblance[r][j] = -1;
+        }
+        //Cada tarefa traz o melhor de uma faixa de velocidades, em
+        //caso de empate vale a faixa avaliada primeiro na busca
+        if(s > semblance[r][i] || (s == semblance[r][i] &&
+            fabs(v-Vini) < fabs(velocidade[r][i]-Vini))){
+            empilhado[r][i] = e;
+            semblance[r][i] = s;
+            velocidade[r][i] = v;
+            if(atributoA){
+                atributoA[r][i] = A;
+                atributoB[r][i] = B;
+            }
+        }
+    }
 
 public:
     committer(int argc, const char *argv[], spitz::istream& jobinfo) :
-        p(argc, argv, "[CO] ")
+        p(argc, argv, "[CO] "), atributoA(NULL), atributoB(NULL), nb(p.buscas.size()),
+        componentes(p.crs.md > 0 ? 5 : 3), arquivoDiario(-1), quantidadePendentes(0),
+        sincronizado(std::chrono::steady_clock::now())
     {
-        int i;
-        //Leitura do arquivo
-        if(!LeitorArquivoSUCommit(p.arquivo.c_str(), &(p.listaTracos), &p.tamanhoLista, p.aph, p.azimuth, &ns)){
+        bool retomar;
+        size_t k;
+        //Leitura dos cabecalhos, com a aperture da leitura do job manager
+        if(!LeitorIndiceSU(p.arquivo.c_str(), &(p.listaTracos), &p.tamanhoLista, p.aphLeitura(), p.azimuth)){
             std::cerr << "ERRO NA LEITURA " << p.arquivo.c_str() << std::endl;
             std::cout << p.who << "ERRO NA LEITURA" << std::endl;
             exit(1);
         }
         cdps = p.tamanhoLista;
+        ns = cdps > 0 ? p.listaTracos[0]->tracos[0]->ns : 0;
+        indexar();
+        LiberarMemoria(&(p.listaTracos), &(p.tamanhoLista));
+        tempos.resize(cdps, 0);
+        recebidas.resize(cdps, 0);
+        gravados.resize(cdps, false);
+
+        //Os resultados de cada CDP sao alocados na primeira tarefa e
+        //liberados assim que gravados
+        semblance = (float**) calloc(cdps*nb, sizeof(float*));
+        empilhado = (float**) calloc(cdps*nb, sizeof(float*));
+        velocidade = (float**) calloc(cdps*nb, sizeof(float*));
+        if(p.crs.md > 0){
+            atributoA = (float**) calloc(cdps*nb, sizeof(float*));
+            atributoB = (float**) calloc(cdps*nb, sizeof(float*));
+        }
 
-        semblance = (float**) malloc(sizeof(float*)*cdps);
-        empilhado = (float**) malloc(sizeof(float*)*cdps);
-        velocidade = (float**) malloc(sizeof(float*)*cdps);
-        for(i=0; i<cdps; i++){
-            semblance[i] = (float*) malloc(sizeof(float)*ns);
-            empilhado[i] = (float*) malloc(sizeof(float)*ns);
-            velocidade[i] = (float*) malloc(sizeof(float)*ns);
+        chave = ChaveDiario(p);
+        for(k=0; k<nb; k++){
+            saidas.push_back(p.nomeSaida(k, "empilhado"));
+            saidas.push_back(p.nomeSaida(k, "semblance"));
+            saidas.push_back(p.nomeSaida(k, "V"));
+            if(p.crs.md > 0){
+                saidas.push_back(p.nomeSaida(k, "A"));
+                saidas.push_back(p.nomeSaida(k, "B"));
+            }
+        }
+        for(k=0; k<saidas.size(); k++)
+            arquivos.push_back(abrir(saidas[k]));
+
+        if(!p.diario.empty()){
+            //Todos os committers do job escrevem no mesmo arquivo. Sob a
+            //trava, o primeiro de um job novo o esvazia e grava a chave, e
+            //os seguintes encontram a chave e apenas o continuam
+            std::string linha = chave + "\n";
+            arquivoDiario = open(p.diario.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+            if(arquivoDiario < 0 || flock(arquivoDiario, LOCK_EX) != 0){
+                std::cerr << "ERRO NA ESCRITA " << p.diario << std::endl;
+                exit(1);
+            }
+            retomar = LerDiario(p, chave, gravados);
+            if(!retomar && (ftruncate(arquivoDiario, 0) != 0 ||
+                write(arquivoDiario, linha.c_str(), linha.size()) != (ssize_t) linha.size() ||
+                fsync(arquivoDiario) != 0)){
+                std::cerr << "ERRO NA ESCRITA " << p.diario << std::endl;
+                exit(1);
+            }
+            if(retomar && std::count(gravados.begin(), gravados.end(), true) > 0)
+                std::cout << p.who << "Resuming from " << p.diario << std::endl;
+            flock(arquivoDiario, LOCK_UN);
         }
 
         std::cout << "[CO] Committer created." << std::endl;
@@ -426,6 +1882,9 @@ public:
     int commit_task(spitz::istream& result)
     {        
         int i;
+        size_t k;
+        float e, s, v, A = 0, B = 0, tempo;
+        bool avaliada;
         
         std::cout << "[CO] Committing result " << std::endl;
 
@@ -434,56 +1893,160 @@ public:
 
             result >> ncdp;
             result >> cdp;
+            result >> tempo;
+            tempos[ncdp] += tempo;
             std::cout << "[CO] Committing result of CDP " << cdp << "(" << ncdp << ")" << std::endl;
-            for(i=0; i<ns; i++){
-                result >> empilhado[ncdp][i];
-                result >> semblance[ncdp][i];
-                result >> velocidade[ncdp][i];
+            //Somente as buscas com velocidades na faixa da tarefa
+            for(k=0; k<nb; k++){
+                result >> avaliada;
+                for(i=0; i<ns && avaliada; i++){
+                    result >> e;
+                    result >> s;
+                    result >> v;
+                    if(atributoA){
+                        result >> A;
+                        result >> B;
+                    }
+                    acumular(ncdp, k, e, s, v, i, A, B);
+                }
             }
+            if(++recebidas[ncdp] == p.faixas())
+                gravar(ncdp);
         }
         
         return 0;
     }
 
-    int commit_job(const spitz::pusher& final_result)
+    // The state of a committer that received part of the results is the
+    // list of CDPs it wrote and the partial results of the others. The
+    // committer gives it away, it is finalized after the merge.
+    int serialize_state(const spitz::pusher& state)
     {
-        int i;
         spitz::ostream o;
-        char saida[101], saidaEmpilhado[104], saidaSemblance[104], saidaV[104];
-        FILE *arquivoEmpilhado, *arquivoSemblance, *arquivoV;
-        Traco tracoSemblance, tracoEmpilhado, tracoV;
+        int c, i;
+        size_t k, r;
+        bool parcial;
+
+        o << cdps;
+        o << ns;
+        o << (int) nb;
+        for(c=0; c<cdps; c++){
+            if(recebidas[c] == 0 && !gravados[c]) continue;
+            o << c;
+            o << recebidas[c];
+            o << (bool) gravados[c];
+            o << tempos[c];
+            for(k=0; k<nb; k++){
+                r = c*nb+k;
+                parcial = !gravados[c] && semblance[r];
+                o << parcial;
+                for(i=0; i<ns && parcial; i++){
+                    o << empilhado[r][i];
+                    o << semblance[r][i];
+                    o << velocidade[r][i];
+                    if(atributoA){
+                        o << atributoA[r][i];
+                        o << atributoB[r][i];
+                    }
+                }
+            }
+            liberar(c);
+            recebidas[c] = 0;
+        }
+        //Os CDPs gravados vao para o diario antes de o estado sair
+        sincronizarDiario();
+        state.push(o);
+        return 0;
+    }
 
-        std::cout << "COMMIT JOB" << std::endl;
+    int merge_state(spitz::istream& state)
+    {
+        int c, i, n, outroNs, outrasBuscas, outrasRecebidas;
+        size_t k;
+        bool outroGravado, parcial;
+        double tempo;
+        float e, s, v, A = 0, B = 0;
+
+        state >> n;
+        state >> outroNs;
+        state >> outrasBuscas;
+        if(n != cdps || outroNs != ns || outrasBuscas != (int) nb){
+            std::cerr << p.who << "Committer state of another job" << std::endl;
+            return 1;
+        }
+        while(state.has_data()){
+            state >> c;
+            state >> outrasRecebidas;
+            state >> outroGravado;
+            state >> tempo;
+            for(k=0; k<nb; k++){
+                state >> parcial;
+                for(i=0; i<ns && parcial; i++){
+                    state >> e;
+                    state >> s;
+                    state >> v;
+                    if(atributoA){
+                        state >> A;
+                        state >> B;
+                    }
+                    acumular(c, k, e, s, v, i, A, B);
+                }
+            }
+            tempos[c] += tempo;
+            recebidas[c] += outrasRecebidas;
+            if(outroGravado){
+                gravados[c] = true;
+                liberar(c);
+            }
+            else if(recebidas[c] == p.faixas())
+                gravar(c);
+        }
+        return 0;
+    }
 
-        strncpy(saida,p.arquivo.c_str(),strlen(p.arquivo.c_str())-3);
-        strncpy(saidaEmpilhado,saida,strlen(p.arquivo.c_str())-3);
-        strcat(saidaEmpilhado,"-empilhado.out3.su");
-        arquivoEmpilhado = fopen(saidaEmpilhado,"w");
-        strncpy(saidaSemblance,saida,strlen(p.arquivo.c_str())-3);
-        strcat(saidaSemblance,"-semblance.out3.su");
-        arquivoSemblance = fopen(saidaSemblance,"w");
-        strncpy(saidaV,saida,strlen(p.arquivo.c_str())-3);
-        strcat(saidaV,"-V.out3.su");
-        arquivoV = fopen(saidaV,"w");
+    int commit_job(const spitz::pusher& final_result)
+    {
+        off_t tamanho;
+        size_t k;
 
+        std::cout << "COMMIT JOB" << std::endl;
 
-        // Push the result
-        for(cdp=0; cdp<cdps; cdp++){            
-            memcpy(&tracoEmpilhado,p.listaTracos[cdp]->tracos[0], SEISMIC_UNIX_HEADER);
-            SetCabecalhoCMP(&tracoEmpilhado);
-            memcpy(&tracoSemblance,&tracoEmpilhado, SEISMIC_UNIX_HEADER);
-            memcpy(&tracoV,&tracoEmpilhado, SEISMIC_UNIX_HEADER);
+        for(cdp=0; cdp<cdps; cdp++){
+            if(!gravados[cdp]){
+                std::cerr << "[CO] CDP " << cdp << " has no result!" << std::endl;
+                return 1;
+            }
+        }
+        for(k=0; k<arquivos.size(); k++){
+            tamanho = (off_t) totais[k/componentes] * (SEISMIC_UNIX_HEADER + sizeof(float) * ns);
+            if(ftruncate(arquivos[k], tamanho) != 0){
+                std::cerr << "ERRO NA ESCRITA DOS ARQUIVOS DE SAIDA" << std::endl;
+                return 1;
+            }
+            close(arquivos[k]);
+            arquivos[k] = -1;
+        }
 
-            //Copiar os tracos resultantes nos arquivos de saida
-            fwrite(&tracoEmpilhado,SEISMIC_UNIX_HEADER,1,arquivoEmpilhado);
-            fwrite((empilhado[cdp]),sizeof(float),ns,arquivoEmpilhado);
-            fwrite(&tracoSemblance,SEISMIC_UNIX_HEADER,1,arquivoSemblance);
-            fwrite((semblance[cdp]),sizeof(float),ns,arquivoSemblance);
-            fwrite(&tracoV,SEISMIC_UNIX_HEADER,1,arquivoV);
-            fwrite((velocidade[cdp]),sizeof(float),ns,arquivoV);
+        printf("SALVO NOS ARQUIVOS:\n");
+        for(k=0; k<saidas.size(); k++)
+            printf("\t%s\n",saidas[k].c_str());
+
+        //O job terminou, uma nova execucao recalcula todos os CDPs
+        if(arquivoDiario >= 0){
+            close(arquivoDiario);
+            arquivoDiario = -1;
+            unlink(p.diario.c_str());
         }
 
-        printf("SALVO NOS ARQUIVOS:\n\t%s\n\t%s\n\t%s\n",saidaEmpilhado,saidaSemblance,saidaV);
+        //Tempos medidos de cada CDP para a ordem das proximas execucoes,
+        //os CDPs de uma execucao anterior nao foram medidos
+        if(!p.calibracao.empty()){
+            std::ofstream calibracao(p.calibracao.c_str());
+            for(cdp=0; cdp<cdps; cdp++)
+                if(recebidas[cdp] > 0)
+                    calibracao << numeros[cdp] << " " << tempos[cdp] << std::endl;
+            std::cout << p.who << "Calibration saved in " << p.calibracao << std::endl;
+        }
 
         final_result.push(NULL, 0);
         return 0;
@@ -491,15 +2054,27 @@ public:
 
     ~committer()
     {   
-        int i;
-        for(i=0; i<cdps ; i++){
+        size_t i;
+        for(i=0; i<cdps*nb; i++){
             free(semblance[i]);
             free(empilhado[i]);
             free(velocidade[i]);
+            if(atributoA){
+                free(atributoA[i]);
+                free(atributoB[i]);
+            }
         }
         free(semblance);
         free(empilhado);
         free(velocidade);
+        free(atributoA);
+        free(atributoB);
+        if(arquivoDiario >= 0){
+            sincronizarDiario();
+            close(arquivoDiario);
+        }
+        for(i=0; i<arquivos.size(); i++)
+            if(arquivos[i] >= 0) close(arquivos[i]);
         std::cout << "[CO] Committer destroyed." << std::endl;
     }
 };
@@ -9,18 +9,32 @@
 #define SEISMICUNIX_H
 #endif
 
-bool LeitorArquivoSU(const char *argumento, ListaTracos ***listaTracos, int *tamanhoLista, float aph, float azimuth)
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <vector>
+#include <thread>
+#include <algorithm>
+
+static bool LeitorTracosSU(const char *argumento, ListaTracos ***listaTracos, int *tamanhoLista, float aph, float azimuth, bool amostras)
 {
     int i;
     int flag;
     float hx, hy, h;
     Traco *traco;
+    struct stat st;
     FILE *arquivo = fopen(argumento, "r");
 
 
 	if(arquivo == NULL){
 		return false;
 	}
+    if(fstat(fileno(arquivo), &st) != 0){
+        fclose(arquivo);
+        return false;
+    }
 
     (*tamanhoLista) = 0;
 
@@ -28,16 +42,25 @@ bool LeitorArquivoSU(const char *argumento, ListaTracos ***listaTracos, int *tam
     while(1){
         //Aloca memoria para um traco
         traco = (Traco*) malloc(sizeof(Traco));
+        traco->posicao = ftell(arquivo);
 
         //Leitura do cabecalho do traco
         if(fread(traco, SEISMIC_UNIX_HEADER, 1, arquivo) < 1) break;
         
-        //Aloca memoria para os dados sismicos
-        //traco->ns numero de amostras
-        traco->dados = (float*) malloc(sizeof(float) * traco->ns);
+        //Sem as amostras, somente o cabecalho fica em memoria
+        if(!amostras){
+            traco->dados = NULL;
+            if(traco->posicao + SEISMIC_UNIX_HEADER + (long) sizeof(float) * traco->ns > st.st_size) break;
+            if(fseek(arquivo, sizeof(float) * traco->ns, SEEK_CUR) != 0) break;
+        }
+        else{
+            //Aloca memoria para os dados sismicos
+            //traco->ns numero de amostras
+            traco->dados = (float*) malloc(sizeof(float) * traco->ns);
 
-        //Leitura das amostras
-        if(fread(traco->dados, sizeof(float), traco->ns, arquivo) < 1) break;
+            //Leitura das amostras
+            if(fread(traco->dados, sizeof(float), traco->ns, arquivo) < 1) break;
+        }
         
         //Verificar o aperture
         OffsetSU(traco,&hx,&hy);
@@ -102,6 +125,150 @@ bool LeitorArquivoSU(const char *argumento, ListaTracos ***listaTracos, int *tam
 }
 
 
+bool LeitorArquivoSU(const char *argumento, ListaTracos ***listaTracos, int *tamanhoLista, float aph, float azimuth)
+{
+    return LeitorTracosSU(argumento, listaTracos, tamanhoLista, aph, azimuth, true);
+}
+
+
+bool LeitorIndiceSU(const char *argumento, ListaTracos ***listaTracos, int *tamanhoLista, float aph, float azimuth)
+{
+    return LeitorTracosSU(argumento, listaTracos, tamanhoLista, aph, azimuth, false);
+}
+
+
+bool LerAmostrasSU(int arquivo, ListaTracos *lista)
+{
+    int i;
+    ssize_t tamanho;
+    Traco *traco;
+    for(i=0; i<lista->tamanho; i++){
+        traco = lista->tracos[i];
+        if(traco->dados != NULL) continue;
+        traco->dados = (float*) malloc(sizeof(float) * traco->ns);
+        tamanho = sizeof(float) * traco->ns;
+        if(pread(arquivo, traco->dados, tamanho, traco->posicao + SEISMIC_UNIX_HEADER) != tamanho)
+            return false;
+    }
+    return true;
+}
+
+
+void LiberarAmostrasSU(ListaTracos *lista)
+{
+    int i;
+    for(i=0; i<lista->tamanho; i++){
+        free(lista->tracos[i]->dados);
+        lista->tracos[i]->dados = NULL;
+    }
+}
+
+
+void AnteciparAmostrasSU(int arquivo, ListaTracos *lista)
+{
+    int i;
+    for(i=0; i<lista->tamanho; i++)
+        posix_fadvise(arquivo, lista->tracos[i]->posicao + SEISMIC_UNIX_HEADER,
+            sizeof(float) * lista->tracos[i]->ns, POSIX_FADV_WILLNEED);
+}
+
+
+bool AbrirLeitorSU(const char *arquivo, LeitorSU *leitor)
+{
+    leitor->arquivo = fopen(arquivo, "r");
+    leitor->proximo = NULL;
+    leitor->ultimoCdp = 0;
+    leitor->iniciado = 0;
+    return leitor->arquivo != NULL;
+}
+
+
+int ProximoCDPSU(LeitorSU *leitor, ListaTracos **lista, float aph, float azimuth)
+{
+    float hx, hy, h;
+    Traco *traco;
+
+    *lista = NULL;
+    //Leitura de um traco por vez, ate o traco de outro CDP
+    while(1){
+        traco = leitor->proximo;
+        leitor->proximo = NULL;
+        if(traco == NULL){
+            traco = (Traco*) malloc(sizeof(Traco));
+            traco->posicao = ftell(leitor->arquivo);
+            if(fread(traco, SEISMIC_UNIX_HEADER, 1, leitor->arquivo) < 1){
+                free(traco);
+                break;
+            }
+            traco->dados = (float*) malloc(sizeof(float) * traco->ns);
+            if(fread(traco->dados, sizeof(float), traco->ns, leitor->arquivo) < 1){
+                free(traco->dados);
+                free(traco);
+                break;
+            }
+
+            //Verificar o aperture
+            OffsetSU(traco,&hx,&hy);
+            hx/=2;
+            hy/=2;
+            h = hx * sin(azimuth) + hy * cos(azimuth);
+            if(h < 0) h = -h;
+            if(h >= aph){
+                free(traco->dados);
+                free(traco);
+                continue;
+            }
+        }
+
+        //O traco de outro CDP fica para a proxima chamada
+        if(*lista != NULL && traco->cdp != (*lista)->cdp){
+            leitor->proximo = traco;
+            break;
+        }
+        if(*lista == NULL){
+            if(leitor->iniciado && traco->cdp <= leitor->ultimoCdp){
+                free(traco->dados);
+                free(traco);
+                return -1;
+            }
+            leitor->iniciado = 1;
+            leitor->ultimoCdp = traco->cdp;
+            *lista = (ListaTracos*) malloc(sizeof(ListaTracos));
+            (*lista)->cdp = traco->cdp;
+            (*lista)->capacidade = 10;
+            (*lista)->tamanho = 0;
+            (*lista)->numeroVizinhos = 0;
+            (*lista)->vizinhos = NULL;
+            (*lista)->tracos = (Traco**) malloc(sizeof(Traco*)*10);
+        }
+        if((*lista)->capacidade <= (*lista)->tamanho){
+            (*lista)->tracos = (Traco**) realloc((*lista)->tracos,((*lista)->tamanho+10)*sizeof(Traco*));
+            (*lista)->capacidade = (*lista)->tamanho+10;
+        }
+        (*lista)->tracos[(*lista)->tamanho] = traco;
+        (*lista)->tamanho++;
+    }
+
+    if(*lista == NULL) return 0;
+
+    //Ordenar por offset o conjunto
+    qsort((*lista)->tracos,(*lista)->tamanho,sizeof(Traco**),comparaOffset);
+    return 1;
+}
+
+
+void FecharLeitorSU(LeitorSU *leitor)
+{
+    if(leitor->proximo != NULL){
+        free(leitor->proximo->dados);
+        free(leitor->proximo);
+        leitor->proximo = NULL;
+    }
+    if(leitor->arquivo != NULL) fclose(leitor->arquivo);
+    leitor->arquivo = NULL;
+}
+
+
 bool LeitorArquivoSUCommit(const char *argumento, ListaTracos ***listaTracos, int *tamanhoLista, float aph, float azimuth, int *ns)
 {
     int i;
@@ -121,6 +288,7 @@ bool LeitorArquivoSUCommit(const char *argumento, ListaTracos ***listaTracos, in
     while(1){
         //Aloca memoria para um traco
         traco = (Traco*) malloc(sizeof(Traco));
+        traco->posicao = ftell(arquivo);
 
         //Leitura do cabecalho do traco
         if(fread(traco, SEISMIC_UNIX_HEADER, 1, arquivo) < 1) break;
@@ -255,6 +423,58 @@ bool LeitorArquivoSUCommit2(const char *argumento, int *tamanho, int *ns)
 }
 
 
+bool IdentidadeArquivoSU(const char *arquivo, long *tamanho, long *modificacao)
+{
+    struct stat info;
+    if(stat(arquivo, &info) != 0) return false;
+    *tamanho = info.st_size;
+    *modificacao = info.st_mtime;
+    return true;
+}
+
+const char* MapearArquivoSU(const char *arquivo, long *tamanho)
+{
+    struct stat info;
+    void *mapa;
+    int fd = open(arquivo, O_RDONLY);
+
+    if(fd < 0) return NULL;
+    if(fstat(fd, &info) != 0){
+        close(fd);
+        return NULL;
+    }
+    *tamanho = info.st_size;
+    mapa = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    //O mapeamento continua valido apos fechar o descritor
+    close(fd);
+    if(mapa == MAP_FAILED) return NULL;
+    return (const char*) mapa;
+}
+
+void DesmapearArquivoSU(const char *mapa, long tamanho)
+{
+    if(mapa != NULL) munmap((void*) mapa, tamanho);
+}
+
+bool LeitorTracoMapeadoSU(const char *mapa, long tamanho, long posicao, TracosCDP *traco)
+{
+    Traco cabecalho;
+
+    if(posicao < 0 || posicao + SEISMIC_UNIX_HEADER > tamanho) return false;
+    memcpy(&cabecalho, mapa + posicao, SEISMIC_UNIX_HEADER);
+    if(posicao + SEISMIC_UNIX_HEADER + (long) sizeof(float)*cabecalho.ns > tamanho) return false;
+
+    traco->scalco = cabecalho.scalco;
+    traco->sx = cabecalho.sx;
+    traco->sy = cabecalho.sy;
+    traco->gx = cabecalho.gx;
+    traco->gy = cabecalho.gy;
+    traco->ns = cabecalho.ns;
+    traco->dados = (float*) malloc(sizeof(float) * cabecalho.ns);
+    memcpy(traco->dados, mapa + posicao + SEISMIC_UNIX_HEADER, sizeof(float) * cabecalho.ns);
+    return true;
+}
+
 int comparaCDP(const void* a, const void* b)
 {
     ListaTracos **A = (ListaTracos **) a;
@@ -336,6 +556,72 @@ void ComputarVizinhos(ListaTracos **lista, int tamanho, int traco, float md, flo
     }
 }
 
+// Runs f over [0, tamanho) split into one contiguous part per core
+template<typename F>
+static void ParaleloSU(int tamanho, F f)
+{
+    int partes = std::max(1, std::min((int) std::thread::hardware_concurrency(), tamanho / 4096));
+    std::vector<std::thread> threads;
+    int i;
+    for(i=1; i<partes; i++)
+        threads.push_back(std::thread(f, (long) tamanho * i / partes, (long) tamanho * (i+1) / partes));
+    f(0, (long) tamanho / partes);
+    for(i=0; i<(int) threads.size(); i++)
+        threads[i].join();
+}
+
+int *IndexarVizinhosSU(ListaTracos **lista, int tamanho, float md, float azimuth, long *inicios)
+{
+    std::vector<float> m(tamanho), ordenados(tamanho);
+    std::vector<int> ordem(tamanho), inicio(tamanho), fim(tamanho);
+    int *vizinhos;
+    int i;
+
+    //Ponto medio de cada CDP projetado no azimute, como em ComputarVizinhos
+    ParaleloSU(tamanho, [&](long de, long ate){
+        float x, y;
+        for(long c=de; c<ate; c++){
+            MidpointSU(lista[c]->tracos[0], &x, &y);
+            m[c] = x * sin(azimuth) + y * cos(azimuth);
+        }
+    });
+    for(i=0; i<tamanho; i++)
+        ordem[i] = i;
+    std::sort(ordem.begin(), ordem.end(), [&m](int a, int b){
+        return m[a] < m[b] || (m[a] == m[b] && a < b);
+    });
+    for(i=0; i<tamanho; i++)
+        ordenados[i] = m[ordem[i]];
+
+    //Os vizinhos de um CDP sao um intervalo das projecoes ordenadas. A
+    //diferenca m-v so diminui com v, entao o mesmo teste |m-v| <= md de
+    //ComputarVizinhos delimita o intervalo pela busca binaria.
+    ParaleloSU(tamanho, [&](long de, long ate){
+        for(long c=de; c<ate; c++){
+            float mc = m[c];
+            inicio[c] = std::partition_point(ordenados.begin(), ordenados.end(),
+                [mc, md](float v){ return mc - v > md; }) - ordenados.begin();
+            fim[c] = std::partition_point(ordenados.begin() + inicio[c], ordenados.end(),
+                [mc, md](float v){ return -(mc - v) <= md; }) - ordenados.begin();
+        }
+    });
+    inicios[0] = 0;
+    for(i=0; i<tamanho; i++)
+        inicios[i+1] = inicios[i] + fim[i] - inicio[i] - (md >= 0 ? 1 : 0);
+
+    //Cada CDP escreve a sua parte do vetor, em ordem de CDP
+    vizinhos = (int*) malloc(sizeof(int) * std::max(inicios[tamanho], 1L));
+    ParaleloSU(tamanho, [&](long de, long ate){
+        for(long c=de; c<ate; c++){
+            int *v = vizinhos + inicios[c];
+            for(int k=inicio[c]; k<fim[c]; k++)
+                if(ordem[k] != c) *v++ = ordem[k];
+            std::sort(vizinhos + inicios[c], v);
+        }
+    });
+    return vizinhos;
+}
+
 void PrintVizinhosSU(ListaTracos *tracos)
 {
     int i;
@@ -410,6 +696,18 @@ void PrintTracoSU(Traco *traco)
     printf("\n");
 }
 
+void LiberarListaSU(ListaTracos *lista)
+{
+    int j;
+    for(j=0; j<lista->tamanho; j++){
+        free(lista->tracos[j]->dados);
+        free(lista->tracos[j]);
+    }
+    free(lista->tracos);
+    free(lista->vizinhos);
+    free(lista);
+}
+
 void LiberarMemoriaSU(ListaTracos ***lista, int *tamanho)
 {
     int i, j;
@@ -419,6 +717,7 @@ void LiberarMemoriaSU(ListaTracos ***lista, int *tamanho)
             free((*lista)[i]->tracos[j]);
         }
         free((*lista)[i]->tracos);
+        free((*lista)[i]->vizinhos);
         free((*lista)[i]);
     }
     //free(**lista);
@@ -109,6 +109,7 @@ typedef struct {
   short int shortpad; /**< . */
   int unass[7]; /**< . */
   float *dados; /**< Amostras do traco. */
+  long posicao; /**< Posicao do cabecalho do traco no arquivo. */
 }Traco;
 
 
@@ -141,14 +142,87 @@ typedef struct {
 }TracosCDP;
 
 
+/*! \brief Leitura incremental de um arquivo SU ordenado por CDP.
+*/
+typedef struct {
+  FILE *arquivo; /**< Arquivo aberto. */
+  Traco *proximo; /**< Primeiro traco do proximo CDP, ja lido. */
+  int ultimoCdp; /**< CDP do ultimo conjunto lido. */
+  int iniciado; /**< Se algum conjunto ja foi lido. */
+}LeitorSU;
+
+
 /*
  * Le o arquivo do dado sismico SU.
  */
 bool LeitorArquivoSU(const char* arquivo, ListaTracos ***listaTracos, int *tamanhoLista, float aph, float azimuth);
 bool LeitorArquivoSUCommit(const char* arquivo, ListaTracos ***listaTracos, int *tamanhoLista, float aph, float azimuth, int *ns);
 
+/*
+ * Le somente os cabecalhos do arquivo, agrupados como em LeitorArquivoSU,
+ * com as amostras de cada traco nulas.
+ */
+bool LeitorIndiceSU(const char* arquivo, ListaTracos ***listaTracos, int *tamanhoLista, float aph, float azimuth);
+
+/*
+ * Le as amostras dos tracos de um conjunto lido por LeitorIndiceSU.
+ */
+bool LerAmostrasSU(int arquivo, ListaTracos *lista);
+
+/*
+ * Libera as amostras dos tracos de um conjunto, mantendo os cabecalhos.
+ */
+void LiberarAmostrasSU(ListaTracos *lista);
+
+/*
+ * Avisa o sistema que as amostras de um conjunto serao lidas em breve.
+ */
+void AnteciparAmostrasSU(int arquivo, ListaTracos *lista);
+
 bool LeitorArquivoSUCommit2(const char *argumento, int *tamanho, int *ns);
 
+/*
+ * Abre o arquivo para ler um CDP por vez.
+ */
+bool AbrirLeitorSU(const char *arquivo, LeitorSU *leitor);
+
+/*
+ * Le o proximo conjunto de tracos de mesmo CDP, ordenado por offset.
+ * Retorna 1 se leu um conjunto, 0 no fim do arquivo e -1 se os CDPs do
+ * arquivo nao estao em ordem crescente.
+ */
+int ProximoCDPSU(LeitorSU *leitor, ListaTracos **lista, float aph, float azimuth);
+
+/*
+ * Fecha o arquivo do leitor.
+ */
+void FecharLeitorSU(LeitorSU *leitor);
+
+/*
+ * Libera um conjunto de tracos.
+ */
+void LiberarListaSU(ListaTracos *lista);
+
+/*
+ * Identifica o arquivo pelo tamanho e pela data de modificacao.
+ */
+bool IdentidadeArquivoSU(const char *arquivo, long *tamanho, long *modificacao);
+
+/*
+ * Mapeia o arquivo em memoria somente para leitura.
+ */
+const char* MapearArquivoSU(const char *arquivo, long *tamanho);
+
+/*
+ * Desfaz o mapeamento do arquivo.
+ */
+void DesmapearArquivoSU(const char *mapa, long tamanho);
+
+/*
+ * Le o traco que comeca na posicao dada do arquivo mapeado.
+ */
+bool LeitorTracoMapeadoSU(const char *mapa, long tamanho, long posicao, TracosCDP *traco);
+
 /*
  * Retorna o scalco multiplicado (se positivo) ou dividindo (se negativo).
  */
@@ -170,6 +244,15 @@ void MidpointSU(Traco *traco, float *mx, float *my);
  */
 void ComputarVizinhos(ListaTracos **lista, int tamanho, int traco, float md, float azimuth);
 
+/*
+ * Computa os vizinhos de todos os CDPs, com o mesmo criterio de
+ * ComputarVizinhos, pela busca binaria nos pontos medios ordenados, em
+ * O(N log N) e em paralelo. Os vizinhos do CDP i, em ordem de CDP, sao as
+ * posicoes de inicios[i] a inicios[i+1]-1 do vetor retornado, que deve ser
+ * liberado com free; inicios tem tamanho+1 posicoes.
+ */
+int *IndexarVizinhosSU(ListaTracos **lista, int tamanho, float md, float azimuth, long *inicios);
+
 /*
  * Função para comparar dois offsets
  */
@@ -70,7 +70,7 @@ float SemblanceCMP(ListaTracos *lista, float A, float B, float C, float t0, floa
         amostra = (int) (t/seg);
         //Se a janela da amostra cobre os dados sismicos
             //if(0.00000096154212769761 == C) printf("%d %d %d %d\n", amostra, w, amostra-w, amostra+w);
-        if(amostra - w >= 0 && amostra + w < lista->tracos[traco]->ns){
+        if(amostra - w >= 0 && amostra + w + 1 < lista->tracos[traco]->ns){
             //if(0.00000096154212769761 == C) printf("sim\n");
             //Para cada amostra dentro da janela
             for(j=0; j<janela; j++){
@@ -135,7 +135,7 @@ float Semblance(ListaTracos *lista, float A, float B, float C, float t0, float w
       //Calcular a amostra equivalente ao tempo calculado
       amostra = (int) (t/seg);
       //Se a janela da amostra cobre os dados sismicos
-      if(amostra - w >= 0 && amostra + w < lista->tracos[traco]->ns){
+      if(amostra - w >= 0 && amostra + w + 1 < lista->tracos[traco]->ns){
         //Para cada amostra dentro da janela
         for(j=0; j<janela; j++){
           k = amostra - w + j;
@@ -171,7 +171,7 @@ float Semblance(ListaTracos *lista, float A, float B, float C, float t0, float w
         //Calcular a amostra equivalente ao tempo calculado
         amostra = (int) (t/seg);
         //Se a janela da amostra cobre os dados sismicos
-        if(amostra - w >= 0 && amostra + w < lista->vizinhos[vizinho]->tracos[traco]->ns){
+        if(amostra - w >= 0 && amostra + w + 1 < lista->vizinhos[vizinho]->tracos[traco]->ns){
             //Para cada amostra dentro da janela
             for(j=0; j<janela; j++){
                 k = amostra - w + j;
@@ -216,7 +216,19 @@ float HalfOffsetWorker(TracosCDP *traco, float azimuth)
     return hx * sin(azimuth) + hy * cos(azimuth);
 }
 
+float MidpointWorker(TracosCDP *traco, float azimuth)
+{
+    float scalco;
+    float mx, my;
+    if(traco->scalco > 0) scalco = traco->scalco;
+    else if (traco->scalco < 0) scalco = -1/traco->scalco;
+    else scalco = 1;
+
+    mx = scalco*(traco->gx+traco->sx)/2;
+    my = scalco*(traco->gy+traco->sy)/2;
 
+    return mx * sin(azimuth) + my * cos(azimuth);
+}
 
 
 float SemblanceWorker(TracosCDP **tracos, int tamanho, float A, float B, float C, float t0, float wind, float seg, float *pilha, float azimuth)
@@ -253,7 +265,7 @@ float SemblanceWorker(TracosCDP **tracos, int tamanho, float A, float B, float C
       amostra = ((int) (t/seg));
       
       //Se a janela da amostra cobre os dados sismicos
-      if(amostra - w >= 0 && amostra + w < tracos[traco]->ns){
+      if(amostra - w >= 0 && amostra + w + 1 < tracos[traco]->ns){
         //Para cada amostra dentro da janela
         for(j=0; j<janela; j++){
           k = amostra - w + j;
@@ -282,3 +294,131 @@ float SemblanceWorker(TracosCDP **tracos, int tamanho, float A, float B, float C
     return num / (N * denominador);
 }
 
+void SemblanceJanelas(TracosCDP **tracos, int tamanho, const float *const *h, const float *aph, float C, float t0, const float *wind, int janelas, float seg, float *semblances, float *pilhas)
+{
+    int traco, q;
+    float t = -1, valor, num;
+    int amostra = 0, k, j;
+    int w[janelas], janela[janelas], N[janelas], erro[janelas];
+    float denominador[janelas];
+    const float *anterior;
+    int maior = 0, restantes = janelas;
+
+    for(q=0; q<janelas; q++){
+        w[q] = (int) (wind[q]/seg);
+        janela[q] = 2*w[q]+1;
+        if(janela[q] > maior) maior = janela[q];
+        N[q] = 0;
+        erro[q] = 0;
+        denominador[q] = 0.0;
+        pilhas[q] = 0.0;
+        semblances[q] = 0.0;
+    }
+    //Numeradores de cada busca, lado a lado
+    float numerador[janelas*maior];
+    memset(&numerador,0.0,sizeof(numerador));
+
+    //Para cada traco do conjunto
+    for(traco=0; traco<tamanho && restantes > 0; traco++){
+      anterior = NULL;
+      for(q=0; q<janelas; q++){
+        //A busca ja falhou em dois tracos ou o traco esta fora da aperture
+        if(erro[q] == 2 || !(fabs(h[q][traco]) < aph[q])) continue;
+        if(h[q] != anterior){
+          anterior = h[q];
+          //Calcular o tempo de acordo com a funcao da hiperbole
+          t = time2D(0.0,0.0,C,t0,h[q][traco],0.0);
+          //Calcular a amostra equivalente ao tempo calculado
+          if(t >= 0) amostra = ((int) (t/seg));
+        }
+        if(t < 0) continue;
+
+        //Se a janela da amostra cobre os dados sismicos
+        if(amostra - w[q] >= 0 && amostra + w[q] + 1 < tracos[traco]->ns){
+          for(j=0; j<janela[q]; j++){
+            k = amostra - w[q] + j;
+            //Interpolacao linear entre as duas amostras
+            InterpolacaoLinear(&valor,tracos[traco]->dados[k],tracos[traco]->dados[k+1], t/seg-w[q]+j, k, k+1);
+            numerador[q*maior+j] += valor;
+            denominador[q] += valor*valor;
+            pilhas[q] += valor;
+          }
+          N[q]++;
+        }
+        else if(++erro[q] == 2) restantes--;
+      }
+    }
+
+    for(q=0; q<janelas; q++){
+      if(erro[q] == 2) continue;
+      num = 0;
+      for(j=0; j<janela[q]; j++){
+          num += numerador[q*maior+j]*numerador[q*maior+j];
+      }
+      pilhas[q] = pilhas[q]/N[q]/janela[q];
+      semblances[q] = num / (N[q] * denominador[q]);
+    }
+}
+
+float SemblanceCRS(TracosCDP **tracos, const float *h, const float *md, const int *inicios, int conjuntos, float A, float B, float C, float t0, float wind, float seg, float *pilha)
+{
+    int traco, conjunto;
+    float t;
+    int amostra, k;
+    int w = (int) (wind/seg);
+    int janela = 2*w+1;
+    int N;
+    float numerador[janela], denominador;
+    float num;
+    float valor;
+    int j;
+    int erro;
+    float base;
+
+    //Numerador e denominador da funcao semblance zerados
+    memset(&numerador,0.0,sizeof(numerador));
+    denominador = 0.0;
+    N = 0;
+
+    //Para cada CDP do supergather, o primeiro e o proprio CDP
+    for(conjunto=0; conjunto<conjuntos; conjunto++){
+      erro = 0;
+      //Parte de time2D que depende so do ponto medio, a mesma para todos
+      //os tracos do CDP
+      base = t0+A*md[conjunto];
+      base = base*base;
+      base += B*md[conjunto]*md[conjunto];
+      for(traco=inicios[conjunto]; traco<inicios[conjunto+1]; traco++){
+        //Calcular o tempo de acordo com a superficie CRS
+        t = base + C*h[traco]*h[traco];
+        if(t < 0) continue;
+        t = sqrt(t);
+        //Calcular a amostra equivalente ao tempo calculado
+        amostra = ((int) (t/seg));
+
+        //Se a janela da amostra cobre os dados sismicos
+        if(amostra - w >= 0 && amostra + w + 1 < tracos[traco]->ns){
+          for(j=0; j<janela; j++){
+            k = amostra - w + j;
+            //Interpolacao linear entre as duas amostras
+            InterpolacaoLinear(&valor,tracos[traco]->dados[k],tracos[traco]->dados[k+1], t/seg-w+j, k, k+1);
+            numerador[j] += valor;
+            denominador += valor*valor;
+            *pilha += valor;
+          }
+          N++;
+        }
+        else{
+          erro++;
+        }
+        if(erro == 2) return 0.0;
+      }
+    }
+
+    num = 0;
+    for(j=0; j<janela; j++){
+        num += numerador[j]*numerador[j];
+    }
+    *pilha = (*pilha)/N/janela;
+    return num / (N * denominador);
+}
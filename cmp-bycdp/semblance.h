@@ -31,6 +31,24 @@ float Semblance(ListaTracos *lista, float A, float B, float C, float t0, float w
 
 float SemblanceWorker(TracosCDP **tracos, int tamanho, float A, float B, float C, float t0, float wind, float seg, float *pilha, float azimuth);
 
+/*
+ * Semblance de varias buscas de uma vez sobre os tracos do CDP. Cada busca
+ * tem a sua janela, a sua aperture e a metade do offset dos tracos no seu
+ * azimute, ja calculada. As amostras de um traco sao lidas uma vez para
+ * todas as buscas e o tempo uma vez para as buscas seguidas com a mesma
+ * metade do offset. Cada resultado e igual ao de SemblanceWorker com os
+ * tracos dentro da aperture da busca.
+ */
+void SemblanceJanelas(TracosCDP **tracos, int tamanho, const float *const *h, const float *aph, float C, float t0, const float *wind, int janelas, float seg, float *semblances, float *pilhas);
+
+/*
+ * Semblance CRS de um supergather, com a metade do offset de cada traco e o
+ * deslocamento md[g] do ponto medio de cada CDP ja calculados. Os tracos do
+ * CDP g vao de inicios[g] a inicios[g+1]; dois tracos de um mesmo CDP fora
+ * dos dados anulam o resultado, como em Semblance.
+ */
+float SemblanceCRS(TracosCDP **tracos, const float *h, const float *md, const int *inicios, int conjuntos, float A, float B, float C, float t0, float wind, float seg, float *pilha);
+
 float SemblanceCMP(ListaTracos *lista, float A, float B, float C, float t0, float wind, float seg, float *pilha, float azimuth);
 
 /*
@@ -39,6 +57,11 @@ float SemblanceCMP(ListaTracos *lista, float A, float B, float C, float t0, floa
 float HalfOffset(Traco *traco, float azimuth);
 float HalfOffsetWorker(TracosCDP *traco, float azimuth);
 
+/*
+ * Calcula o ponto medio projetado no azimute.
+ */
+float MidpointWorker(TracosCDP *traco, float azimuth);
+
 
 /*
  * Realiza interpolacao linear.
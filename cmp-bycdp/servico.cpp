@@ -0,0 +1,378 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+// Velocity analysis service. The survey is read once and its gathers stay in
+// memory, and requests arrive over a UNIX socket, one command per line:
+//
+//   info
+//       ok NCDP NS DT, followed by a line with the CDP numbers
+//   painel CDP VINI VFIN VINT WIND APH AZIMUTH
+//       ok NS VINT, followed by NS*VINT floats with the semblance of each
+//       sample (rows) and velocity (columns)
+//   cmp CDP VINI VFIN VINT WIND APH AZIMUTH
+//       ok NS, followed by NS triples of floats with the stack, the
+//       semblance and the velocity picked for each sample, the same values
+//       cmp-bycdp writes for the CDP
+//   fim
+//       closes the connection
+//
+// Floats are sent in the byte order of the machine. A request that cannot
+// be answered gets a line starting with "erro", as do VINT above 8192 and a
+// window WIND as long as the trace.
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <memory>
+#include <cfloat>
+#include <cmath>
+#include <cstring>
+#include <cerrno>
+#include <stdio.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "semblance.h"
+
+//Maior quantidade de velocidades de um pedido, limita a memoria do painel
+#define MAXIMO_VELOCIDADES 8192
+
+// Gathers of the survey, with every trace regardless of the aperture, and
+// the traces of each CDP selected for the aperture and azimuth of recent
+// requests, so that repeated requests on the same CDP skip the selection
+class levantamento
+{
+public:
+    struct selecao
+    {
+        std::vector<TracosCDP> tracos;
+        std::vector<TracosCDP*> ponteiros;
+    };
+
+private:
+    typedef std::pair<int, std::pair<float, float> > chave;
+    typedef std::list<std::pair<chave, std::shared_ptr<selecao> > > lista;
+
+    ListaTracos **listaTracos;
+    int tamanhoLista;
+    std::map<int, int> indices;
+
+    std::mutex m;
+    lista lru;
+    std::map<chave, lista::iterator> selecoes;
+    size_t limite;
+
+public:
+    levantamento() : listaTracos(NULL), tamanhoLista(0), limite(256) { }
+
+    bool ler(const char *arquivo)
+    {
+        int c;
+        if(!LeitorArquivoSU(arquivo, &listaTracos, &tamanhoLista, FLT_MAX, 0))
+            return false;
+        for(c=0; c<tamanhoLista; c++)
+            indices[listaTracos[c]->cdp] = c;
+        return tamanhoLista > 0;
+    }
+
+    int tamanho() const { return tamanhoLista; }
+    ListaTracos *conjunto(int c) const { return listaTracos[c]; }
+
+    int indice(int cdp) const
+    {
+        std::map<int, int>::const_iterator it = indices.find(cdp);
+        return it == indices.end() ? -1 : it->second;
+    }
+
+    // Traces of the CDP inside the aperture, sorted by offset as in the
+    // gathers the job manager sends
+    std::shared_ptr<selecao> selecionar(int c, float aph, float azimuth)
+    {
+        chave k(c, std::make_pair(aph, azimuth));
+        std::shared_ptr<selecao> s;
+        float hx, hy, h;
+        Traco *traco;
+        size_t i;
+        int j;
+        {
+            std::lock_guard<std::mutex> lock(m);
+            std::map<chave, lista::iterator>::iterator it = selecoes.find(k);
+            if(it != selecoes.end()){
+                lru.splice(lru.begin(), lru, it->second);
+                return it->second->second;
+            }
+        }
+
+        s = std::make_shared<selecao>();
+        for(j=0; j<listaTracos[c]->tamanho; j++){
+            traco = listaTracos[c]->tracos[j];
+            OffsetSU(traco,&hx,&hy);
+            hx/=2;
+            hy/=2;
+            h = hx * sin(azimuth) + hy * cos(azimuth);
+            if(h < 0) h = -h;
+            if(h >= aph) continue;
+            TracosCDP t;
+            t.scalco = traco->scalco;
+            t.sx = traco->sx;
+            t.sy = traco->sy;
+            t.gx = traco->gx;
+            t.gy = traco->gy;
+            t.ns = traco->ns;
+            t.dados = traco->dados;
+            s->tracos.push_back(t);
+        }
+        for(i=0; i<s->tracos.size(); i++)
+            s->ponteiros.push_back(&s->tracos[i]);
+
+        std::lock_guard<std::mutex> lock(m);
+        if(!selecoes.count(k)){
+            lru.push_front(std::make_pair(k, s));
+            selecoes[k] = lru.begin();
+            while(lru.size() > limite){
+                selecoes.erase(lru.back().first);
+                lru.pop_back();
+            }
+        }
+        return s;
+    }
+
+    ~levantamento()
+    {
+        LiberarMemoriaSU(&listaTracos, &tamanhoLista);
+    }
+};
+
+struct pedido
+{
+    int cdp;
+    float Vini, Vfin, Vint, wind, aph, azimuth;
+};
+
+// Semblance of every sample and velocity of the CDP, the samples are split
+// among the hardware threads
+static void Painel(levantamento& l, int c, const pedido& q, std::vector<float>& painel,
+    std::vector<float>& pilhas)
+{
+    std::shared_ptr<levantamento::selecao> s = l.selecionar(c, q.aph, q.azimuth);
+    Traco *primeiro = l.conjunto(c)->tracos[0];
+    int ns = primeiro->ns, nv = (int) q.Vint;
+    float seg = ((float) primeiro->dt)/1000000;
+    float Vinc = (q.Vfin-q.Vini)/q.Vint;
+    std::vector<float> C(nv);
+    std::vector<std::thread> threads;
+    int i, n, partes;
+
+    for(i=0; i<nv; i++)
+        C[i] = 4/(Vinc*i+q.Vini)*1/(Vinc*i+q.Vini);
+    painel.assign((size_t) ns * nv, 0);
+    pilhas.assign((size_t) ns * nv, 0);
+    if(s->tracos.empty()) return;
+
+    partes = std::max(1, (int) std::thread::hardware_concurrency());
+    for(n=0; n<partes; n++){
+        threads.push_back(std::thread([&, n](){
+            int a, v;
+            float pilha;
+            for(a=n; a<ns; a+=partes){
+                for(v=0; v<nv; v++){
+                    pilha = 0;
+                    painel[(size_t) a*nv+v] = SemblanceWorker(&s->ponteiros[0], s->ponteiros.size(), 0.0, 0.0,
+                        C[v], a*seg, q.wind, seg, &pilha, q.azimuth);
+                    pilhas[(size_t) a*nv+v] = pilha;
+                }
+            }
+        }));
+    }
+    for(n=0; n<partes; n++)
+        threads[n].join();
+}
+
+static bool Enviar(int fd, const void *dados, size_t tamanho)
+{
+    const char *p = (const char*) dados;
+    ssize_t r;
+    while(tamanho > 0){
+        r = write(fd, p, tamanho);
+        if(r <= 0) return false;
+        p += r;
+        tamanho -= r;
+    }
+    return true;
+}
+
+static bool Enviar(int fd, const std::string& linha)
+{
+    return Enviar(fd, linha.c_str(), linha.size());
+}
+
+static void Atender(levantamento& l, int fd)
+{
+    std::string buffer, linha, comando;
+    std::vector<float> painel, pilhas, saida;
+    char bloco[4096];
+    size_t fim;
+    ssize_t r;
+    pedido q;
+    int c, a, v, ns, nv;
+    float bestS, bestV, pilha;
+
+    try{
+        while(true){
+            while((fim = buffer.find('\n')) == std::string::npos){
+                r = read(fd, bloco, sizeof(bloco));
+                if(r <= 0){
+                    close(fd);
+                    return;
+                }
+                buffer.append(bloco, r);
+            }
+            linha = buffer.substr(0, fim);
+            buffer.erase(0, fim + 1);
+
+            std::istringstream entrada(linha);
+            comando.clear();
+            entrada >> comando;
+            if(comando == "fim") break;
+            if(comando == "info"){
+                std::ostringstream resposta;
+                Traco *primeiro = l.conjunto(0)->tracos[0];
+                resposta << "ok " << l.tamanho() << " " << primeiro->ns << " " << primeiro->dt << "\n";
+                for(c=0; c<l.tamanho(); c++)
+                    resposta << (c ? " " : "") << l.conjunto(c)->cdp;
+                resposta << "\n";
+                if(!Enviar(fd, resposta.str())) break;
+                continue;
+            }
+            if(comando != "painel" && comando != "cmp"){
+                if(!Enviar(fd, "erro comando desconhecido\n")) break;
+                continue;
+            }
+            if(!(entrada >> q.cdp >> q.Vini >> q.Vfin >> q.Vint >> q.wind >> q.aph >> q.azimuth) ||
+                q.Vint < 1 || q.Vint > MAXIMO_VELOCIDADES || q.Vfin <= q.Vini || q.Vini <= 0 || q.wind < 0){
+                if(!Enviar(fd, "erro parametros: CDP VINI VFIN VINT WIND APH AZIMUTH\n")) break;
+                continue;
+            }
+            if((c = l.indice(q.cdp)) < 0){
+                if(!Enviar(fd, "erro CDP inexistente\n")) break;
+                continue;
+            }
+            //A janela deve caber no traco
+            Traco *primeiro = l.conjunto(c)->tracos[0];
+            if(q.wind >= primeiro->ns * (primeiro->dt / 1000000.0)){
+                if(!Enviar(fd, "erro janela maior que o traco\n")) break;
+                continue;
+            }
+
+            Painel(l, c, q, painel, pilhas);
+            ns = l.conjunto(c)->tracos[0]->ns;
+            nv = (int) q.Vint;
+            std::ostringstream resposta;
+            if(comando == "painel"){
+                resposta << "ok " << ns << " " << nv << "\n";
+                if(!Enviar(fd, resposta.str()) || !Enviar(fd, &painel[0], sizeof(float) * painel.size())) break;
+                continue;
+            }
+
+            //Melhor velocidade de cada amostra, como no worker do cmp-bycdp,
+            //que parte do primeiro traco dentro da aperture
+            std::shared_ptr<levantamento::selecao> selecao = l.selecionar(c, q.aph, q.azimuth);
+            float Vinc = (q.Vfin-q.Vini)/q.Vint;
+            saida.resize(3 * ns);
+            for(a=0; a<ns; a++){
+                pilha = selecao->tracos.empty() ? 0 : selecao->tracos[0].dados[a];
+                bestS = 0.0;
+                bestV = 0.0;
+                for(v=0; v<nv && !painel.empty(); v++){
+                    if(painel[(size_t) a*nv+v] > bestS){
+                        bestS = painel[(size_t) a*nv+v];
+                        bestV = Vinc*v+q.Vini;
+                        pilha = pilhas[(size_t) a*nv+v];
+                    }
+                }
+                saida[3*a] = pilha;
+                saida[3*a+1] = bestS;
+                saida[3*a+2] = bestV;
+            }
+            resposta << "ok " << ns << "\n";
+            if(!Enviar(fd, resposta.str()) || !Enviar(fd, &saida[0], sizeof(float) * saida.size())) break;
+        }
+    }
+    catch(const std::exception& e){
+        //Um pedido com erro nao derruba o servico dos outros clientes
+        std::cerr << "ERRO NO PEDIDO: " << e.what() << std::endl;
+        Enviar(fd, "erro pedido\n");
+    }
+    close(fd);
+}
+
+int main(int argc, char *argv[])
+{
+    levantamento l;
+    struct sockaddr_un endereco;
+    int servidor, cliente;
+
+    if(argc < 3){
+        std::cerr << "ERRO: ./servico <dado sismico> <socket>" << std::endl;
+        std::cerr << "\tARQUIVO: arquivo dos tracos sismicos" << std::endl;
+        std::cerr << "\tSOCKET:  caminho do socket UNIX dos pedidos" << std::endl;
+        return 1;
+    }
+    if(strlen(argv[2]) >= sizeof(endereco.sun_path)){
+        std::cerr << "ERRO: caminho do socket muito longo " << argv[2] << std::endl;
+        return 1;
+    }
+
+    //Leitura do arquivo, uma unica vez
+    if(!l.ler(argv[1])){
+        std::cerr << "ERRO NA LEITURA " << argv[1] << std::endl;
+        return 1;
+    }
+    std::cout << "[SV] " << l.tamanho() << " CDPs read from " << argv[1] << std::endl;
+
+    signal(SIGPIPE, SIG_IGN);
+    memset(&endereco, 0, sizeof(endereco));
+    endereco.sun_family = AF_UNIX;
+    strcpy(endereco.sun_path, argv[2]);
+    unlink(argv[2]);
+    servidor = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(servidor < 0 || bind(servidor, (struct sockaddr*) &endereco, sizeof(endereco)) != 0 ||
+        listen(servidor, 16) != 0){
+        std::cerr << "ERRO NO SOCKET " << argv[2] << std::endl;
+        return 1;
+    }
+    std::cout << "[SV] Listening on " << argv[2] << std::endl;
+
+    //Cada conexao e atendida por uma thread
+    while((cliente = accept(servidor, NULL, NULL)) >= 0 || errno == EINTR){
+        if(cliente < 0) continue;
+        std::thread(Atender, std::ref(l), cliente).detach();
+    }
+    close(servidor);
+    return 0;
+}
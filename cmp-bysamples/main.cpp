@@ -41,9 +41,17 @@
 #include <cmath>
 #include <cstring>
 #include <iomanip>
+#include <map>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <chrono>
+#include <thread>
+#include <algorithm>
 #include <stdio.h>
 #include "semblance.h"
 #include <unistd.h>
+#include <fcntl.h>
 
 
 void SetCabecalhoCMP(Traco *traco)
@@ -81,12 +89,35 @@ struct parameters
     int tamanhoLista;
     int cdp;
     int split;
+    std::map<std::string, std::string> opcoes;
+    std::vector<std::string> extras;
+    bool referencia;
+    long cache;
+    int velocidades;
+    float duracao;
+    int trabalhadores;
+    std::string chave;
 
     parameters(int argc, const char *argv[], const std::string& who = "") :
-        split(1000), who(who)
+        who(who), split(1000)
     {
-        if (argc < 8) {
-            std::cerr << "ERRO: ./main <dado sismico> V_INI V_FIN V_INT WIND APH AZIMUTH" << std::endl;
+        std::vector<const char*> args;
+        const char *igual;
+        int i;
+
+        //Opcoes no formato --nome=valor podem aparecer em qualquer posicao
+        for(i=0; i<argc; i++){
+            if(strncmp(argv[i], "--", 2) == 0){
+                igual = strchr(argv[i], '=');
+                if(igual) opcoes[std::string(argv[i]+2, igual)] = igual+1;
+                else opcoes[argv[i]+2] = "1";
+                extras.push_back(argv[i]);
+            }
+            else args.push_back(argv[i]);
+        }
+
+        if (args.size() < 8) {
+            std::cerr << "ERRO: ./main <dado sismico> V_INI V_FIN V_INT WIND APH AZIMUTH [OPCOES]" << std::endl;
             std::cerr << "\tARQUIVO: arquivo dos tracos sismicos" << std::endl;
             std::cerr << "\tV_INI:   velocidade inicial" << std::endl;
             std::cerr << "\tV_FIN:   velocidade final" << std::endl;
@@ -94,22 +125,55 @@ struct parameters
             std::cerr << "\tWIND:    janela do semblance" << std::endl;
             std::cerr << "\tAPH:     aperture" << std::endl;
             std::cerr << "\tAZIMUTH: azimuth" << std::endl;
+            std::cerr << "\t--referencia: envia a posicao dos tracos no arquivo em vez das amostras" << std::endl;
+            std::cerr << "\t--divisao=N:  amostras por tarefa (padrao 500)" << std::endl;
+            std::cerr << "\t--cache=MB:   guarda os CDPs lidos nos workers (implica --referencia)" << std::endl;
+            std::cerr << "\t--velocidades=N: velocidades avaliadas por tarefa (padrao V_INT)" << std::endl;
+            std::cerr << "\t--duracao=S:  ajusta as amostras por tarefa para tarefas de S segundos" << std::endl;
+            std::cerr << "\t--trabalhadores=N: workers considerados no fim do job (padrao: nucleos)" << std::endl;
             exit(1);
         }   
 
         //Leitura dos parametros
-        arquivo = argv[1];
-        Vini = atof(argv[2]);
-        Vfin = atof(argv[3]);
-        Vint = atof(argv[4]);
-        wind = atof(argv[5]);
-        aph = atof(argv[6]);
-        azimuth = atof(argv[7]);
+        arquivo = args[1];
+        Vini = atof(args[2]);
+        Vfin = atof(args[3]);
+        Vint = atof(args[4]);
+        wind = atof(args[5]);
+        aph = atof(args[6]);
+        azimuth = atof(args[7]);
         cdp = -1;
-        if(argc > 8){
-            cdp = atoi(argv[8]);
+        if(args.size() > 8){
+            cdp = atoi(args[8]);
+        }
+        split = atoi(opcao("divisao", "500").c_str());
+        if(split < 1) split = 500;
+        referencia = atoi(opcao("referencia", "0").c_str()) != 0;
+        cache = atol(opcao("cache", "0").c_str()) << 20;
+        //Na falta de um CDP no cache o worker le os tracos do arquivo
+        if(cache > 0) referencia = true;
+        velocidades = atoi(opcao("velocidades", "0").c_str());
+        if(velocidades <= 0 || velocidades > (int) Vint) velocidades = (int) Vint;
+        duracao = atof(opcao("duracao", "0").c_str());
+        trabalhadores = atoi(opcao("trabalhadores", "0").c_str());
+        if(trabalhadores <= 0) trabalhadores = std::max(1u, std::thread::hardware_concurrency());
+        //Identifica o job para as medidas passadas do committer ao job manager
+        for(i=0; i<argc; i++){
+            chave += argv[i];
+            chave += " ";
         }
-        split = 500;        
+    }
+
+    std::string opcao(const std::string& nome, const std::string& padrao) const
+    {
+        std::map<std::string, std::string>::const_iterator it = opcoes.find(nome);
+        return it == opcoes.end() ? padrao : it->second;
+    }
+
+    // Name of an output file, the input file with the suffix of its content
+    std::string nomeSaida(const std::string& tipo) const
+    {
+        return arquivo.substr(0, arquivo.size()-3) + "-" + tipo + ".out.su";
     }
 
     void print()
@@ -131,91 +195,200 @@ public:
     {
         spitz::istream result;
         int r;
-        int tracos, i;
-        char cdpbuffer[6], amostrasbuffer[100];
-        char saida[101], saidaEmpilhado[104], saidaSemblance[104], saidaV[104];
-        FILE *arquivoEmpilhado, *arquivoSemblance, *arquivoV;
-        Traco tracoSemblance, tracoEmpilhado, tracoV;
-        parameters p(argc, argv, "[SM] ");
-
-        //Leitura do arquivo
-        if(!LeitorArquivoSU(p.arquivo.c_str(), &(p.listaTracos), &p.tamanhoLista, p.aph, p.azimuth, p.cdp)){
-            std::cerr << "ERRO NA LEITURA " << p.arquivo.c_str() << std::endl;
-            std::cout << p.who << "ERRO NA LEITURA" << std::endl;
+
+        //Um unico job com as tarefas de todos os CDPs, assim os workers
+        //nao ficam ociosos no fim de cada CDP. O committer grava cada CDP
+        //nos arquivos de saida assim que o seu resultado fica completo
+        r = runner.run(argc, argv, result);
+        if (r != 0) {
+            std::cerr << "[SM] The execution of the job failed with code " << r << "!" << std::endl;
             exit(1);
         }
-        std::cout << "LEITURA DO ARQUIVO COM CDP: " << p.cdp  << " E QUANTIDADE " << p.tamanhoLista << std::endl;
-
-        strncpy(saida,argv[1],strlen(argv[1])-3);
-        strncpy(saidaEmpilhado,saida,strlen(argv[1])-3);
-        strcat(saidaEmpilhado,"-empilhado.out.su");
-        arquivoEmpilhado = fopen(saidaEmpilhado,"w");
-        strncpy(saidaSemblance,saida,strlen(argv[1])-3);
-        strcat(saidaSemblance,"-semblance.out.su");
-        arquivoSemblance = fopen(saidaSemblance,"w");
-        strncpy(saidaV,saida,strlen(argv[1])-3);
-        strcat(saidaV,"-V.out.su");
-        arquivoV = fopen(saidaV,"w");
-
-        for(tracos=0; tracos<p.tamanhoLista; tracos++){
-        //for(tracos=0; tracos<10; tracos++){
-            sprintf(cdpbuffer,"%d",p.listaTracos[tracos]->cdp);
-            sprintf(amostrasbuffer,"%d",p.listaTracos[tracos]->tracos[0]->ns);
-
-            std::cout << "\t" << tracos << "[" << p.listaTracos[tracos]->tamanho << "] (cdp= " << p.listaTracos[tracos]->cdp << ") de " << p.tamanhoLista << std::endl;
-
-
-            memcpy(&tracoEmpilhado,p.listaTracos[tracos]->tracos[0], SEISMIC_UNIX_HEADER);
-            SetCabecalhoCMP(&tracoEmpilhado);
-            memcpy(&tracoSemblance,&tracoEmpilhado, SEISMIC_UNIX_HEADER);
-            memcpy(&tracoV,&tracoEmpilhado, SEISMIC_UNIX_HEADER);
-
-            const char *argvjob[] = { argv[0], argv[1], argv[2], argv[3], argv[4], argv[5], argv[6], argv[7], cdpbuffer, amostrasbuffer };
-            int argcjob = 10;
-            r = runner.run(argcjob, argvjob, result);
-            if (r != 0) {
-                std::cerr << "[SM] The execution of the job failed with code " << r << "!" << std::endl;
-                exit(1);
-            }
 
-            tracoEmpilhado.dados = (float*) malloc(sizeof(float)*p.listaTracos[tracos]->tracos[0]->ns);
-            tracoSemblance.dados = (float*) malloc(sizeof(float)*p.listaTracos[tracos]->tracos[0]->ns);
-            tracoV.dados = (float*) malloc(sizeof(float)*p.listaTracos[tracos]->tracos[0]->ns);
-            for(i=0; i<p.listaTracos[tracos]->tracos[0]->ns; i++)
-            {
-                result >> tracoEmpilhado.dados[i];
-                result >> tracoSemblance.dados[i];
-                result >> tracoV.dados[i];
-                //if(i%200 == 0) std::cout << ">>" << i << " " << tracoEmpilhado.dados[i] << " " << tracoSemblance.dados[i] << " " << tracoV.dados[i] << std::endl;
+        return 0;
+    }
+};
+
+//Hash FNV-1a de 64 bits
+uint64_t HashFNV(const void *dados, size_t tamanho, uint64_t h = 14695981039346656037ULL)
+{
+    const unsigned char *p = (const unsigned char*) dados;
+    size_t i;
+    for(i=0; i<tamanho; i++){
+        h ^= p[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// Gathers already read by the workers of this process, indexed by the
+// identity of their content (input file and position of the traces).
+// The cache is shared by every worker of the process because the tasks of
+// a CDP may run on any worker, while the gather is the same.
+class cache_gathers
+{
+public:
+    struct gather
+    {
+        TracosCDP **tracos;
+        int tamanho;
+        size_t bytes;
+
+        gather(TracosCDP **tracos, int tamanho, size_t bytes) :
+            tracos(tracos), tamanho(tamanho), bytes(bytes)
+        {
+        }
+
+        ~gather()
+        {
+            int i;
+            for(i=0; i<tamanho; i++){
+                free(tracos[i]->dados);
+                free(tracos[i]);
             }
+            free(tracos);
+        }
+    };
 
-            std::cout << "CDP: " << tracoEmpilhado.cdp << " " << tracoSemblance.cdp << " " << tracoV.cdp << std::endl;
+private:
+    typedef std::list<std::pair<uint64_t, std::shared_ptr<gather> > > lista;
+
+    std::mutex m;
+    lista lru;
+    std::map<uint64_t, lista::iterator> indice;
+    size_t bytes;
+    long acertos, faltas;
+    int usuarios;
 
+    cache_gathers() : bytes(0), acertos(0), faltas(0), usuarios(0) { }
 
-            //Copiar os tracos resultantes nos arquivos de saida
-            fwrite(&tracoEmpilhado,SEISMIC_UNIX_HEADER,1,arquivoEmpilhado);
-            fwrite(&(tracoEmpilhado.dados[0]),sizeof(float),tracoEmpilhado.ns,arquivoEmpilhado);
-            fwrite(&tracoSemblance,SEISMIC_UNIX_HEADER,1,arquivoSemblance);
-            fwrite(&(tracoSemblance.dados[0]),sizeof(float),tracoSemblance.ns,arquivoSemblance);
-            fwrite(&tracoV,SEISMIC_UNIX_HEADER,1,arquivoV);
-            fwrite(&(tracoV.dados[0]),sizeof(float),tracoV.ns,arquivoV);
+public:
+    static cache_gathers& instancia()
+    {
+        static cache_gathers c;
+        return c;
+    }
 
-            //Liberar memoria alocada nos dados do traco resultante
-            free(tracoEmpilhado.dados);
-            free(tracoSemblance.dados);
-            free(tracoV.dados);
+    std::shared_ptr<gather> buscar(uint64_t id)
+    {
+        std::lock_guard<std::mutex> lock(m);
+        std::map<uint64_t, lista::iterator>::iterator it = indice.find(id);
+        if(it == indice.end()){
+            faltas++;
+            return std::shared_ptr<gather>();
         }
+        acertos++;
+        //Mais recentemente usado no inicio da lista
+        lru.splice(lru.begin(), lru, it->second);
+        return it->second->second;
+    }
 
+    void inserir(uint64_t id, const std::shared_ptr<gather>& g, size_t limite)
+    {
+        std::lock_guard<std::mutex> lock(m);
+        if(indice.count(id)) return;
+        lru.push_front(std::make_pair(id, g));
+        indice[id] = lru.begin();
+        bytes += g->bytes;
+        //Descarta os menos usados, os workers que ainda usam um
+        //gather descartado mantem a sua referencia
+        while(bytes > limite && lru.size() > 1){
+            bytes -= lru.back().second->bytes;
+            indice.erase(lru.back().first);
+            lru.pop_back();
+        }
+    }
 
-        fclose(arquivoEmpilhado);
-        fclose(arquivoSemblance);
-        fclose(arquivoV);
+    void estatisticas(long *a, long *f)
+    {
+        std::lock_guard<std::mutex> lock(m);
+        *a = acertos;
+        *f = faltas;
+    }
 
-        LiberarMemoria(&(p.listaTracos), &(p.tamanhoLista));
+    // The cache is shared by the workers of the process, the last one to
+    // leave reports the statistics
+    void entrar()
+    {
+        std::lock_guard<std::mutex> lock(m);
+        usuarios++;
+    }
 
-        std::cout << "SALVO NOS ARQUIVOS:\n\t" << saidaEmpilhado << "\n\t" << saidaSemblance << "\n\t" << saidaV << std::endl;
+    bool sair()
+    {
+        std::lock_guard<std::mutex> lock(m);
+        return --usuarios == 0;
+    }
+};
 
-        return 0;
+// Execution time of the tasks of each job, measured by the workers and
+// recorded by the committer. The job manager and the committer of a job
+// always run in the same process, so the job manager reads it to size
+// the next tasks. The cost of a sample depends on its depth, so the time
+// is kept per band of samples, as seconds per sample, trace and velocity.
+class medidas_tarefas
+{
+public:
+    static const int faixas = 16;
+
+private:
+    struct perfil
+    {
+        double tempo[faixas], unidades[faixas];
+    };
+
+    std::mutex m;
+    std::map<std::string, perfil> perfis;
+
+    medidas_tarefas() { }
+
+public:
+    static medidas_tarefas& instancia()
+    {
+        static medidas_tarefas c;
+        return c;
+    }
+
+    static int faixa(int amostra, int ns)
+    {
+        return (int) ((long) amostra * faixas / ns);
+    }
+
+    // The time of a task is split among its samples evenly
+    void registrar(const std::string& chave, int ns, int amostra, int namostras, int peso, float tempo)
+    {
+        std::lock_guard<std::mutex> lock(m);
+        std::map<std::string, perfil>::iterator it = perfis.find(chave);
+        if(it == perfis.end()){
+            perfil p;
+            std::fill(p.tempo, p.tempo + faixas, 0.0);
+            std::fill(p.unidades, p.unidades + faixas, 0.0);
+            it = perfis.insert(std::make_pair(chave, p)).first;
+        }
+        for(int a=amostra; a<amostra+namostras; a++){
+            it->second.tempo[faixa(a, ns)] += (double) tempo / namostras;
+            it->second.unidades[faixa(a, ns)] += peso;
+        }
+    }
+
+    // Seconds per sample, trace and velocity of each band, bands without
+    // measures take the average of all. False while nothing was measured.
+    bool taxas(const std::string& chave, double taxa[faixas])
+    {
+        std::lock_guard<std::mutex> lock(m);
+        std::map<std::string, perfil>::iterator it = perfis.find(chave);
+        double tempo = 0, unidades = 0;
+        int f;
+        if(it == perfis.end()) return false;
+        for(f=0; f<faixas; f++){
+            tempo += it->second.tempo[f];
+            unidades += it->second.unidades[f];
+        }
+        if(unidades <= 0) return false;
+        for(f=0; f<faixas; f++)
+            taxa[f] = it->second.unidades[f] > 0 ?
+                it->second.tempo[f] / it->second.unidades[f] : tempo / unidades;
+        return true;
     }
 };
 
@@ -224,18 +397,70 @@ class job_manager : public spitz::job_manager
 {
 private:
     parameters p;
-    int amostra, amostras;
+    int lista, amostra, fimAmostra, velocidade;
+    long tamanhoArquivo, modificacaoArquivo;
+    std::vector<float> Cvector;
+    //Soma dos tracos dos CDPs a partir de cada um
+    std::vector<double> foldRestante;
+
+    // Tasks per worker kept until the end of the job
+    static const int tarefasPorTrabalhador = 2;
+
+    // Samples of the next range of a CDP. With --duracao the range is
+    // sized from the measured cost so the task takes about that long, but
+    // never more than its share of the remaining work, so the last tasks
+    // shrink and every worker still gets some. Until the first measures
+    // arrive the fixed split is used.
+    int tamanhoFaixa(ListaTracos *cdp, int amostra)
+    {
+        int ns = cdp->tracos[0]->ns;
+        int resto = ns - amostra;
+        double taxa[medidas_tarefas::faixas];
+        double alvo, restante, porTraco, acumulado, peso;
+        int a, n;
+
+        if(p.duracao <= 0 || !medidas_tarefas::instancia().taxas(p.chave, taxa))
+            return std::min(p.split, resto);
+
+        //Trabalho restante: o resto deste CDP e todos os seguintes
+        porTraco = 0;
+        for(a=0; a<ns; a++)
+            porTraco += taxa[medidas_tarefas::faixa(a, ns)] * p.Vint;
+        restante = porTraco * foldRestante[lista+1];
+        for(a=amostra; a<ns; a++)
+            restante += taxa[medidas_tarefas::faixa(a, ns)] * p.Vint * cdp->tamanho;
+        alvo = std::min((double) p.duracao, restante / (tarefasPorTrabalhador * p.trabalhadores));
+
+        peso = (double) cdp->tamanho * std::min(p.velocidades, (int) p.Vint);
+        acumulado = 0;
+        for(n=0; n<resto && (n == 0 || acumulado < alvo); n++)
+            acumulado += taxa[medidas_tarefas::faixa(amostra+n, ns)] * peso;
+        return n;
+    }
 
 public:
     job_manager(int argc, const char *argv[], spitz::istream& jobinfo) :
-        p(argc, argv, "[JM] "), amostra(0), amostras(atoi(argv[9]))
+        p(argc, argv, "[JM] "), lista(0), amostra(0), fimAmostra(0), velocidade(0)
     {
-        //Leitura do arquivo
-        if(!LeitorArquivoSU(p.arquivo.c_str(), &(p.listaTracos), &p.tamanhoLista, p.aph, p.azimuth, p.cdp)){
+        //Leitura do arquivo, com --referencia os workers leem as amostras
+        //e o job manager guarda somente os cabecalhos
+        if(!(p.referencia ?
+            LeitorIndiceSU(p.arquivo.c_str(), &(p.listaTracos), &p.tamanhoLista, p.aph, p.azimuth, p.cdp) :
+            LeitorArquivoSU(p.arquivo.c_str(), &(p.listaTracos), &p.tamanhoLista, p.aph, p.azimuth, p.cdp)) ||
+            !IdentidadeArquivoSU(p.arquivo.c_str(), &tamanhoArquivo, &modificacaoArquivo)){
             std::cerr << "ERRO NA LEITURA " << p.arquivo.c_str() << std::endl;
             std::cout << p.who << "ERRO NA LEITURA" << std::endl;
             exit(1);
         }
+        //Os mesmos C calculados pelos workers
+        float Vinc = (p.Vfin-p.Vini)/(p.Vint);
+        for(int i=0; i<p.Vint; i++){
+            float V = Vinc*i+p.Vini;
+            Cvector.push_back(4/V*1/V);
+        }
+        foldRestante.resize(p.tamanhoLista+1, 0);
+        for(int c=p.tamanhoLista-1; c>=0; c--)
+            foldRestante[c] = foldRestante[c+1] + p.listaTracos[c]->tamanho;
         std::cout << "[JM] Job manager created." << std::endl;
     }
 
@@ -244,36 +469,87 @@ public:
         spitz::ostream o;
         int i, j;
         int total;
-        float seg = ((float) p.listaTracos[0]->tracos[0]->dt)/1000000;
-        int w = (int) (p.wind/seg);
-
-        if(amostra >= amostras){
+        int inicio, fim;
+        int vfim;
+        uint64_t id;
+        ListaTracos *cdp;
+        float seg, Cmax;
+
+        //Proximo bloco (CDP, intervalo de amostras, faixa de velocidades),
+        //percorrendo as velocidades e depois as amostras de um CDP antes
+        //de passar para o seguinte
+        if(velocidade >= (int) p.Vint){
+            amostra = fimAmostra;
+            velocidade = 0;
+        }
+        if(lista < p.tamanhoLista && amostra >= p.listaTracos[lista]->tracos[0]->ns){
+            lista++;
+            amostra = 0;
+        }
+        if(lista >= p.tamanhoLista){
             return false;
         }
-
-        if(amostra + p.split > amostras) total = amostras;
-        else total = amostra + p.split;
-
-        o << p.cdp;
+        cdp = p.listaTracos[lista];
+        seg = ((float) cdp->tracos[0]->dt)/1000000;
+
+        if(velocidade == 0)
+            fimAmostra = amostra + tamanhoFaixa(cdp, amostra);
+        total = fimAmostra;
+        vfim = velocidade + p.velocidades;
+        if(vfim > (int) p.Vint) vfim = (int) p.Vint;
+
+        //Maior C da faixa, que limita o trecho dos tracos enviado
+        Cmax = 0;
+        for(i=velocidade; i<vfim; i++)
+            if(Cvector[i] > Cmax) Cmax = Cvector[i];
+
+        o << lista;
+        o << cdp->cdp;
         o << amostra;
         o << (total-amostra);
-        o << p.listaTracos[0]->tamanho;
-        o << p.listaTracos[0]->tracos[0]->dt;
-        o << p.listaTracos[0]->tracos[0]->ns;
-        for(i=0; i<p.listaTracos[0]->tamanho; i++){
-            o << p.listaTracos[0]->tracos[i]->scalco;
-            o << p.listaTracos[0]->tracos[i]->sx;
-            o << p.listaTracos[0]->tracos[i]->sy;
-            o << p.listaTracos[0]->tracos[i]->gx;
-            o << p.listaTracos[0]->tracos[i]->gy;
-            for(j=0; j<p.listaTracos[0]->tracos[i]->ns; j++)
-                o << p.listaTracos[0]->tracos[i]->dados[j];
-            //if(amostra > 2) std::cout << p.who << "VVVVVVVVVVVVV" << j << std::endl;
+        o << velocidade;
+        o << vfim;
+        o << cdp->tamanho;
+        o << cdp->tracos[0]->dt;
+        o << cdp->tracos[0]->ns;
+        o << p.referencia;
+        o << (p.cache > 0);
+        if(p.referencia){
+            //Somente a identidade do arquivo e a posicao de cada traco,
+            //o worker le as amostras do mesmo arquivo
+            o << (int64_t) tamanhoArquivo;
+            o << (int64_t) modificacaoArquivo;
+            if(p.cache > 0){
+                //Identificador do conteudo do CDP para o cache dos workers
+                id = HashFNV(&tamanhoArquivo, sizeof(tamanhoArquivo));
+                id = HashFNV(&modificacaoArquivo, sizeof(modificacaoArquivo), id);
+                for(i=0; i<cdp->tamanho; i++)
+                    id = HashFNV(&(cdp->tracos[i]->posicao), sizeof(long), id);
+                o << id;
+            }
+            for(i=0; i<cdp->tamanho; i++)
+                o << (int64_t) cdp->tracos[i]->posicao;
+        }
+        else{
+            for(i=0; i<cdp->tamanho; i++){
+                o << cdp->tracos[i]->scalco;
+                o << cdp->tracos[i]->sx;
+                o << cdp->tracos[i]->sy;
+                o << cdp->tracos[i]->gx;
+                o << cdp->tracos[i]->gy;
+                //Somente a faixa de tempo que a tarefa pode ler
+                IntervaloAmostras(HalfOffset(cdp->tracos[i],p.azimuth), Cmax,
+                    amostra, total-amostra, p.wind, seg, cdp->tracos[i]->ns, &inicio, &fim);
+                o << inicio;
+                o << (fim-inicio);
+                for(j=inicio; j<fim; j++)
+                    o << cdp->tracos[i]->dados[j];
+            }
         }
 
-        std::cout << p.who << "Generated task for CDP: "<< p.cdp << "(" << amostra << " of " << p.listaTracos[0]->tracos[0]->ns << ")" << std::endl;
+        std::cout << p.who << "Generated task for CDP: "<< cdp->cdp << "(" << amostra << " of " << cdp->tracos[0]->ns << ", velocidades " << velocidade << " a " << vfim << ")" << std::endl;
 
-        amostra += p.split;
+        velocidade = vfim;
 
         task.push(o);
         return true;
@@ -295,11 +571,36 @@ class worker : public spitz::worker
 private:
     parameters p;
     TracosCDP **tracos;
-    int tamanho, namostras;
+    int indice, tamanho, namostras, fatia;
+    const char *mapa;
+    long tamanhoMapa;
+
+    // Maps the input file on the first task sent by reference and checks
+    // that it is the same file seen by the job manager
+    bool mapear(int64_t tamanhoArquivo, int64_t modificacaoArquivo)
+    {
+        long tamanho, modificacao;
+
+        if(!IdentidadeArquivoSU(p.arquivo.c_str(), &tamanho, &modificacao) ||
+            tamanho != tamanhoArquivo || modificacao != modificacaoArquivo){
+            std::cerr << p.who << "ARQUIVO DIFERENTE DO JOB MANAGER " << p.arquivo << std::endl;
+            return false;
+        }
+        if(mapa == NULL)
+            mapa = MapearArquivoSU(p.arquivo.c_str(), &tamanhoMapa);
+        if(mapa == NULL){
+            std::cerr << p.who << "ERRO NO MAPEAMENTO " << p.arquivo << std::endl;
+            return false;
+        }
+        return true;
+    }
 
 public:
-    worker(int argc, const char *argv[]) : p(argc, argv, "[WK] ")
+    worker(int argc, const char *argv[]) : p(argc, argv, "[WK] "),
+        mapa(NULL), tamanhoMapa(0)
     {
+        if(p.cache > 0)
+            cache_gathers::instancia().entrar();
         //p.print();
         std::cout << "[WK] Worker created." << argc << std::endl;
     }
@@ -314,6 +615,12 @@ public:
         short int dt, ns;
         int w;
         int j;
+        bool referencia, usaCache;
+        int64_t tamanhoArquivo, modificacaoArquivo, posicao;
+        uint64_t id;
+        std::shared_ptr<cache_gathers::gather> gather;
+        int vinicio, vfim;
+        std::chrono::steady_clock::time_point inicio;
         //Calculo de V e C para a busca
         Vinc = (p.Vfin-p.Vini)/(p.Vint);
         Vvector = (float*) malloc(sizeof(float)*(p.Vint));
@@ -323,50 +630,91 @@ public:
             Cvector[i] = 4/Vvector[i]*1/Vvector[i];
         }
 
-        //CDP
+        //CDP e sua posicao no arquivo
+        task >> indice;
         task >> p.cdp;
         //Amostra a tratar
         task >> amostra;
         //Quantidade de amostras
         task >> namostras;
+        //Faixa de velocidades avaliadas
+        task >> vinicio;
+        task >> vfim;
         task >> tamanho;
         task >> dt;
         task >> ns;
+        task >> referencia;
+        task >> usaCache;
+        if(referencia){
+            task >> tamanhoArquivo;
+            task >> modificacaoArquivo;
+            if(!mapear(tamanhoArquivo, modificacaoArquivo)){
+                free(Vvector);
+                free(Cvector);
+                return 1;
+            }
+        }
+        if(usaCache){
+            task >> id;
+            gather = cache_gathers::instancia().buscar(id);
+        }
 
         //Tempo entre amostras, convertido para segundos
         seg = ((float) dt)/1000000;
-        tracos = (TracosCDP**) malloc(sizeof(TracosCDP*)*tamanho);
+        tracos = gather ? gather->tracos : (TracosCDP**) malloc(sizeof(TracosCDP*)*tamanho);
 
-        for(i=0; i<tamanho; i++){
+        for(i=0; i<tamanho && !gather; i++){
             tracos[i] = (TracosCDP*) malloc(sizeof(TracosCDP));
+            if(referencia){
+                //Leitura do traco direto do arquivo mapeado
+                task >> posicao;
+                if(!LeitorTracoMapeadoSU(mapa, tamanhoMapa, posicao, tracos[i])){
+                    std::cerr << p.who << "TRACO FORA DO ARQUIVO " << posicao << std::endl;
+                    exit(1);
+                }
+                continue;
+            }
             task >> tracos[i]->scalco;
             task >> tracos[i]->sx;
             task >> tracos[i]->sy;
             task >> tracos[i]->gx;
             task >> tracos[i]->gy;
             tracos[i]->ns = ns;
-            tracos[i]->dados = (float*) malloc(sizeof(float)*ns);
+            //Trecho do traco enviado pelo job manager
+            task >> tracos[i]->inicio;
+            task >> fatia;
+            tracos[i]->dados = (float*) malloc(sizeof(float)*fatia);
             //std::cout << tracos[i]->scalco << " " << tracos[i]->sx << " " << tracos[i]->sy << " " << tracos[i]->gx << " " << tracos[i]->gy << std::endl;
-            for(j=0; j<ns; j++)
+            for(j=0; j<fatia; j++)
                 task >> tracos[i]->dados[j];
         }
+        if(usaCache && !gather){
+            //O cache passa a ser o dono dos tracos lidos
+            gather = std::make_shared<cache_gathers::gather>(tracos, tamanho,
+                (size_t) tamanho * (sizeof(TracosCDP) + sizeof(float) * ns));
+            cache_gathers::instancia().inserir(id, gather, p.cache);
+        }
         std::cout << "WORKING ON " << amostra << " to " << amostra+namostras << " samples of CDP " << p.cdp << std::endl;
 
 
+        o << indice;
+        o << (int) ns;
         o << amostra;
         o << namostras;
+        o << (vfim - vinicio);
         pilha = 0;
+        inicio = std::chrono::steady_clock::now();
         for(a=amostra; a<amostra+namostras; a++){
             //Calcula o segundo inicial
             t0 = a*seg;
 
             //Inicializar variaveis antes da busca
-            pilha = tracos[0]->dados[a];
+            pilha = tracos[0]->dados[a-tracos[0]->inicio];
             bestS = 0.0;
             bestV = 0.0;
 
-            //Para cada velocidade
-            for(i=0; i<p.Vint; i++){
+            //Para cada velocidade da faixa
+            for(i=vinicio; i<vfim; i++){
                 //Calcular semblance
                 pilhaTemp = 0;
                 s = SemblanceWorker(tracos,tamanho,0.0,0.0,Cvector[i],t0,p.wind,seg,&pilhaTemp,p.azimuth);
@@ -385,9 +733,18 @@ public:
             o << bestS;
             o << bestV;
         }
+        //Tempo da tarefa e o seu peso, tracos vezes velocidades
+        o << std::chrono::duration<float>(std::chrono::steady_clock::now() - inicio).count();
+        o << tamanho * (vfim - vinicio);
 
         result.push(o);
 
+        //Liberar memoria alocada para a tarefa
+        for(i=0; i<tamanho && !gather; i++){
+            free(tracos[i]->dados);
+            free(tracos[i]);
+        }
+        if(!gather) free(tracos);
         free(Vvector);
         free(Cvector);
 
@@ -396,13 +753,13 @@ public:
 
     ~worker()
     {
-        int i, j;
-        for(i=0; i<tamanho; i++){
-            for(j=0; j<namostras; j++)
-                free(tracos[i]->dados);
-            free(tracos[i]);
+        long acertos, faltas;
+        if(p.cache > 0 && cache_gathers::instancia().sair()){
+            cache_gathers::instancia().estatisticas(&acertos, &faltas);
+            std::cout << "[WK] Gather cache of all workers: " << acertos << " hits, " << faltas << " misses." << std::endl;
         }
-        free(tracos);
+        DesmapearArquivoSU(mapa, tamanhoMapa);
+        std::cout << "[WK] Worker destroyed." << std::endl;
     }
 };
 
@@ -412,68 +769,272 @@ public:
 class committer : public spitz::committer
 {
 private:
+    struct saida
+    {
+        std::vector<float> semblance, empilhado, velocidade;
+    };
+
     parameters p;
-    float *semblance, *empilhado, *velocidade;
-    int amostras;
+    int cdps;
+    //Amostras de cada CDP, posicao do seu traco nos arquivos de saida e
+    //cabecalho do traco de saida
+    std::vector<int> amostras;
+    std::vector<off_t> posicoes;
+    std::vector<Traco> cabecalhos;
+    off_t tamanhoSaida;
+    //Amostras vezes velocidades recebidas de cada CDP
+    std::vector<long> recebidas;
+    std::vector<bool> gravados;
+    //Resultados parciais dos CDPs que ainda nao foram gravados
+    std::map<int, saida> saidas;
+    //Empilhado, semblance e V
+    std::vector<std::string> nomes;
+    std::vector<int> arquivos;
+
+    // The files are not truncated because several committers of the same
+    // job may write to them, every slot is rewritten and commit_job cuts
+    // what is left of a previous output
+    int abrir(const std::string& nome)
+    {
+        int fd = open(nome.c_str(), O_WRONLY | O_CREAT, 0644);
+        if(fd < 0){
+            std::cerr << "ERRO NA ESCRITA " << nome << std::endl;
+            exit(1);
+        }
+        return fd;
+    }
+
+    saida& buscar(int indice)
+    {
+        saida& s = saidas[indice];
+        if(s.semblance.empty()){
+            //Qualquer resultado parcial substitui o valor inicial
+            s.semblance.resize(amostras[indice], -1);
+            s.empilhado.resize(amostras[indice]);
+            s.velocidade.resize(amostras[indice]);
+        }
+        return s;
+    }
+
+    // Keeps the best of a range of velocities for the sample
+    void acumular(saida& s, int i, float e, float sb, float v)
+    {
+        //Cada tarefa traz o melhor de uma faixa de velocidades, em
+        //caso de empate vale a faixa avaliada primeiro na busca
+        if(sb > s.semblance[i] || (sb == s.semblance[i] &&
+            fabs(v-p.Vini) < fabs(s.velocidade[i]-p.Vini))){
+            s.empilhado[i] = e;
+            s.semblance[i] = sb;
+            s.velocidade[i] = v;
+        }
+    }
+
+    // Each CDP has a fixed slot in the output files, so it can be written as
+    // soon as all of its tiles arrive, in any order
+    void gravar(int fd, int c, const float *dados)
+    {
+        std::vector<char> registro(SEISMIC_UNIX_HEADER + sizeof(float) * amostras[c]);
+        memcpy(&registro[0], &cabecalhos[c], SEISMIC_UNIX_HEADER);
+        memcpy(&registro[SEISMIC_UNIX_HEADER], dados, sizeof(float) * amostras[c]);
+        if(pwrite(fd, &registro[0], registro.size(), posicoes[c]) != (ssize_t) registro.size()){
+            std::cerr << "ERRO NA ESCRITA DO CDP " << c << std::endl;
+            exit(1);
+        }
+    }
+
+    // Counts the samples and velocities of a CDP that arrived, writing and
+    // releasing it once all of them did
+    void receber(int c, long unidades)
+    {
+        std::map<int, saida>::iterator it;
+        recebidas[c] += unidades;
+        if(recebidas[c] < (long) amostras[c] * (int) p.Vint) return;
+        it = saidas.find(c);
+        gravar(arquivos[0], c, &(it->second.empilhado[0]));
+        gravar(arquivos[1], c, &(it->second.semblance[0]));
+        gravar(arquivos[2], c, &(it->second.velocidade[0]));
+        std::cout << "CDP: " << cabecalhos[c].cdp << std::endl;
+        gravados[c] = true;
+        saidas.erase(it);
+    }
 
 public:
     committer(int argc, const char *argv[], spitz::istream& jobinfo) :
-        p(argc, argv, "[CO] "), amostras(atoi(argv[9]))
+        p(argc, argv, "[CO] "), tamanhoSaida(0)
     {
-        semblance = (float*) malloc(sizeof(float)*amostras);
-        empilhado = (float*) malloc(sizeof(float)*amostras);
-        velocidade = (float*) malloc(sizeof(float)*amostras);
-        
+        int c;
+        size_t k;
+        //Leitura dos cabecalhos, os tracos de saida seguem a ordem do
+        //job manager
+        if(!LeitorIndiceSU(p.arquivo.c_str(), &(p.listaTracos), &p.tamanhoLista, p.aph, p.azimuth, p.cdp)){
+            std::cerr << "ERRO NA LEITURA " << p.arquivo.c_str() << std::endl;
+            std::cout << p.who << "ERRO NA LEITURA" << std::endl;
+            exit(1);
+        }
+        cdps = p.tamanhoLista;
+        amostras.resize(cdps);
+        posicoes.resize(cdps);
+        cabecalhos.resize(cdps);
+        for(c=0; c<cdps; c++){
+            amostras[c] = p.listaTracos[c]->tracos[0]->ns;
+            posicoes[c] = tamanhoSaida;
+            tamanhoSaida += SEISMIC_UNIX_HEADER + sizeof(float) * amostras[c];
+            memcpy(&cabecalhos[c], p.listaTracos[c]->tracos[0], SEISMIC_UNIX_HEADER);
+            SetCabecalhoCMP(&cabecalhos[c]);
+        }
+        LiberarMemoria(&(p.listaTracos), &(p.tamanhoLista));
+        recebidas.resize(cdps, 0);
+        gravados.resize(cdps, false);
+
+        nomes.push_back(p.nomeSaida("empilhado"));
+        nomes.push_back(p.nomeSaida("semblance"));
+        nomes.push_back(p.nomeSaida("V"));
+        for(k=0; k<nomes.size(); k++)
+            arquivos.push_back(abrir(nomes[k]));
+
         std::cout << "[CO] Committer created." << std::endl;
     }
 
     int commit_task(spitz::istream& result)
     {        
         
-        int amostra, namostras, i;
+        int indice, ns, amostra, namostras, velocidades, i, peso;
+        float e, sb, v, tempo;
         
         std::cout << "[CO] Committing result " << std::endl;
 
         // Accumulate each term of the expansion        
         while(result.has_data()) {
+            result >> indice;
+            result >> ns;
             result >> amostra;
             result >> namostras;
+            result >> velocidades;
+            if(indice < 0 || indice >= cdps || ns != amostras[indice] || gravados[indice]){
+                std::cerr << "[CO] Unexpected result for CDP " << indice << "!" << std::endl;
+                return 1;
+            }
+            saida& s = buscar(indice);
             for(i=amostra; i<amostra+namostras; i++){
-                result >> empilhado[i];
-                result >> semblance[i];
-                result >> velocidade[i];
-                //if(i%500 == 0)
-                //std::cout << p.who << " " << i << "\tp:" << empilhado[i] << " s=" << semblance[i] << " v=" << velocidade[i] << std::endl;
+                result >> e;
+                result >> sb;
+                result >> v;
+                acumular(s, i, e, sb, v);
             }
+            result >> tempo;
+            result >> peso;
+            medidas_tarefas::instancia().registrar(p.chave, ns, amostra, namostras, peso, tempo);
+            receber(indice, (long) namostras * velocidades);
         }
         
         return 0;
     }
 
-    int commit_job(const spitz::pusher& final_result)
+    // The state of a committer that received part of the results is the
+    // list of CDPs it wrote and the partial results of the others. The
+    // committer gives it away, it is finalized after the merge.
+    int serialize_state(const spitz::pusher& state)
     {
-        int i;
         spitz::ostream o;
-        
+        int c, i;
+        bool parcial;
+        std::map<int, saida>::iterator it;
+
+        o << cdps;
+        for(c=0; c<cdps; c++){
+            if(recebidas[c] == 0) continue;
+            o << c;
+            o << recebidas[c];
+            o << (bool) gravados[c];
+            it = saidas.find(c);
+            parcial = it != saidas.end();
+            o << parcial;
+            for(i=0; i<amostras[c] && parcial; i++){
+                o << it->second.empilhado[i];
+                o << it->second.semblance[i];
+                o << it->second.velocidade[i];
+            }
+            recebidas[c] = 0;
+        }
+        saidas.clear();
+        state.push(o);
+        return 0;
+    }
+
+    int merge_state(spitz::istream& state)
+    {
+        int c, n, i;
+        long outrasRecebidas;
+        bool outroGravado, parcial;
+        float e, sb, v;
+
+        state >> n;
+        if(n != cdps){
+            std::cerr << p.who << "Committer state of another job" << std::endl;
+            return 1;
+        }
+        while(state.has_data()){
+            state >> c;
+            state >> outrasRecebidas;
+            state >> outroGravado;
+            state >> parcial;
+            if(c < 0 || c >= cdps){
+                std::cerr << p.who << "Committer state of another job" << std::endl;
+                return 1;
+            }
+            for(i=0; i<amostras[c] && parcial; i++){
+                state >> e;
+                state >> sb;
+                state >> v;
+                acumular(buscar(c), i, e, sb, v);
+            }
+            if(outroGravado){
+                gravados[c] = true;
+                recebidas[c] += outrasRecebidas;
+                saidas.erase(c);
+            }
+            else
+                receber(c, outrasRecebidas);
+        }
+        return 0;
+    }
+
+    int commit_job(const spitz::pusher& final_result)
+    {
+        size_t k;
+        int c;
+
         std::cout << "COMMIT JOB" << std::endl;
-        
-        // Push the result
-        for(i=0; i<amostras; i++){
-            o << empilhado[i];
-            o << semblance[i];
-            o << velocidade[i];
-            //if(i%200 == 0) std::cout << p.who << " " << i << " p=" << empilhado[i] << " s=" << semblance[i] << " v=" << velocidade[i] << std::endl;
-            final_result.push(o);
+
+        for(c=0; c<cdps; c++){
+            if(!gravados[c]){
+                std::cerr << "[CO] CDP " << cabecalhos[c].cdp << " has no result!" << std::endl;
+                return 1;
+            }
         }
-        
+        for(k=0; k<arquivos.size(); k++){
+            if(ftruncate(arquivos[k], tamanhoSaida) != 0){
+                std::cerr << "ERRO NA ESCRITA DOS ARQUIVOS DE SAIDA" << std::endl;
+                return 1;
+            }
+            close(arquivos[k]);
+            arquivos[k] = -1;
+        }
+
+        std::cout << "SALVO NOS ARQUIVOS:";
+        for(k=0; k<nomes.size(); k++)
+            std::cout << "\n\t" << nomes[k];
+        std::cout << std::endl;
+
+        final_result.push(NULL, 0);
         return 0;
     }
 
     ~committer()
     {
-        free(semblance);
-        free(empilhado);
-        free(velocidade);
+        size_t k;
+        for(k=0; k<arquivos.size(); k++)
+            if(arquivos[k] >= 0) close(arquivos[k]);
         std::cout << "[CO] Committer destroyed." << std::endl;
     }
 };
@@ -9,18 +9,29 @@
 #define SEISMICUNIX_H
 #endif
 
-bool LeitorArquivoSU(const char *argumento, ListaTracos ***listaTracos, int *tamanhoLista, float aph, float azimuth, int cdp)
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static bool LeitorTracosSU(const char *argumento, ListaTracos ***listaTracos, int *tamanhoLista, float aph, float azimuth, int cdp, bool amostras)
 {
     int i;
     int flag;
     float hx, hy, h;
     Traco *traco;
+    struct stat st;
     FILE *arquivo = fopen(argumento, "r");
 
 
 	if(arquivo == NULL){
 		return false;
 	}
+    if(fstat(fileno(arquivo), &st) != 0){
+        fclose(arquivo);
+        return false;
+    }
 
     (*tamanhoLista) = 0;
 
@@ -28,18 +39,27 @@ bool LeitorArquivoSU(const char *argumento, ListaTracos ***listaTracos, int *tam
     while(1){
         //Aloca memoria para um traco
         traco = (Traco*) malloc(sizeof(Traco));
+        traco->posicao = ftell(arquivo);
 
         //Leitura do cabecalho do traco
         if(fread(traco, SEISMIC_UNIX_HEADER, 1, arquivo) < 1) break;
         
-        //Aloca memoria para os dados sismicos
-        //traco->ns numero de amostras
-        traco->dados = (float*) malloc(sizeof(float) * traco->ns);
+        //Sem as amostras, somente o cabecalho fica em memoria
+        if(!amostras){
+            traco->dados = NULL;
+            if(traco->posicao + SEISMIC_UNIX_HEADER + (long) sizeof(float) * traco->ns > st.st_size) break;
+            if(fseek(arquivo, sizeof(float) * traco->ns, SEEK_CUR) != 0) break;
+        }
+        else{
+            //Aloca memoria para os dados sismicos
+            //traco->ns numero de amostras
+            traco->dados = (float*) malloc(sizeof(float) * traco->ns);
 
-        //PrintTracoCabecalhoSU(traco);
+            //PrintTracoCabecalhoSU(traco);
 
-        //Leitura das amostras
-        if(fread(traco->dados, sizeof(float), traco->ns, arquivo) < 1) break;
+            //Leitura das amostras
+            if(fread(traco->dados, sizeof(float), traco->ns, arquivo) < 1) break;
+        }
         
         //std::cout << traco->cdp << "\t" << std::endl;
 
@@ -121,6 +141,69 @@ bool LeitorArquivoSU(const char *argumento, ListaTracos ***listaTracos, int *tam
     return true;
 }
 
+bool LeitorArquivoSU(const char *argumento, ListaTracos ***listaTracos, int *tamanhoLista, float aph, float azimuth, int cdp)
+{
+    return LeitorTracosSU(argumento, listaTracos, tamanhoLista, aph, azimuth, cdp, true);
+}
+
+bool LeitorIndiceSU(const char *argumento, ListaTracos ***listaTracos, int *tamanhoLista, float aph, float azimuth, int cdp)
+{
+    return LeitorTracosSU(argumento, listaTracos, tamanhoLista, aph, azimuth, cdp, false);
+}
+
+bool IdentidadeArquivoSU(const char *arquivo, long *tamanho, long *modificacao)
+{
+    struct stat info;
+    if(stat(arquivo, &info) != 0) return false;
+    *tamanho = info.st_size;
+    *modificacao = info.st_mtime;
+    return true;
+}
+
+const char* MapearArquivoSU(const char *arquivo, long *tamanho)
+{
+    struct stat info;
+    void *mapa;
+    int fd = open(arquivo, O_RDONLY);
+
+    if(fd < 0) return NULL;
+    if(fstat(fd, &info) != 0){
+        close(fd);
+        return NULL;
+    }
+    *tamanho = info.st_size;
+    mapa = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    //O mapeamento continua valido apos fechar o descritor
+    close(fd);
+    if(mapa == MAP_FAILED) return NULL;
+    return (const char*) mapa;
+}
+
+void DesmapearArquivoSU(const char *mapa, long tamanho)
+{
+    if(mapa != NULL) munmap((void*) mapa, tamanho);
+}
+
+bool LeitorTracoMapeadoSU(const char *mapa, long tamanho, long posicao, TracosCDP *traco)
+{
+    Traco cabecalho;
+
+    if(posicao < 0 || posicao + SEISMIC_UNIX_HEADER > tamanho) return false;
+    memcpy(&cabecalho, mapa + posicao, SEISMIC_UNIX_HEADER);
+    if(posicao + SEISMIC_UNIX_HEADER + (long) sizeof(float)*cabecalho.ns > tamanho) return false;
+
+    traco->scalco = cabecalho.scalco;
+    traco->sx = cabecalho.sx;
+    traco->sy = cabecalho.sy;
+    traco->gx = cabecalho.gx;
+    traco->gy = cabecalho.gy;
+    traco->ns = cabecalho.ns;
+    traco->inicio = 0;
+    traco->dados = (float*) malloc(sizeof(float) * cabecalho.ns);
+    memcpy(traco->dados, mapa + posicao + SEISMIC_UNIX_HEADER, sizeof(float) * cabecalho.ns);
+    return true;
+}
+
 int comparaCDP(const void* a, const void* b)
 {
     ListaTracos **A = (ListaTracos **) a;
@@ -109,6 +109,7 @@ typedef struct {
   short int shortpad; /**< . */
   int unass[7]; /**< . */
   float *dados; /**< Amostras do traco. */
+  long posicao; /**< Posicao do cabecalho do traco no arquivo. */
 }Traco;
 
 
@@ -134,10 +135,11 @@ typedef struct {
   int sy; /**< Coordenada Y da fonte. */
   int gx; /**< Coordenada X dos receptores. */
   int gy; /**< Coordenada Y dos receptores. */
-  int ns;
+  int ns; /**< Número de amostras do traco completo. */
+  int inicio; /**< Indice no traco completo da primeira amostra em dados. */
   //short int ns; /**< Número de amostras. */
   //short int dt; /**< Intervado das amostras em microsegundos. */
-  float *dados; /**< Amostras do traco. */
+  float *dados; /**< Amostras do traco a partir de inicio. */
 }TracosCDP;
 
 
@@ -146,6 +148,32 @@ typedef struct {
  */
 bool LeitorArquivoSU(const char* arquivo, ListaTracos ***listaTracos, int *tamanhoLista, float aph, float azimuth, int cdp);
 
+/*
+ * Le somente os cabecalhos do arquivo, agrupados como em LeitorArquivoSU,
+ * com as amostras de cada traco nulas.
+ */
+bool LeitorIndiceSU(const char* arquivo, ListaTracos ***listaTracos, int *tamanhoLista, float aph, float azimuth, int cdp);
+
+/*
+ * Identifica o arquivo pelo tamanho e pela data de modificacao.
+ */
+bool IdentidadeArquivoSU(const char *arquivo, long *tamanho, long *modificacao);
+
+/*
+ * Mapeia o arquivo em memoria somente para leitura.
+ */
+const char* MapearArquivoSU(const char *arquivo, long *tamanho);
+
+/*
+ * Desfaz o mapeamento do arquivo.
+ */
+void DesmapearArquivoSU(const char *mapa, long tamanho);
+
+/*
+ * Le o traco que comeca na posicao dada do arquivo mapeado.
+ */
+bool LeitorTracoMapeadoSU(const char *mapa, long tamanho, long posicao, TracosCDP *traco);
+
 /*
  * Retorna o scalco multiplicado (se positivo) ou dividindo (se negativo).
  */
@@ -20,6 +20,21 @@ float time2D(float A, float B, float C, float t0, float h, float md)
     return sqrt(temp);
 }
 
+void IntervaloAmostras(float h, float Cmax, int amostra, int namostras, float wind, float seg, int ns, int *inicio, int *fim)
+{
+    int w = (int) (wind/seg);
+    float t;
+    //Como C > 0 o tempo nunca e menor que t0, o maior tempo e o da
+    //ultima amostra com o maior C. Uma amostra de folga em cada lado
+    //cobre o arredondamento do calculo em float
+    t = time2D(0.0,0.0,Cmax,(amostra+namostras-1)*seg,h,0.0);
+    *inicio = amostra - w - 1;
+    *fim = ((int) (t/seg)) + w + 3;
+    if(*inicio < 0) *inicio = 0;
+    if(*fim > ns) *fim = ns;
+    if(*fim < *inicio) *fim = *inicio;
+}
+
 float HalfOffset(Traco *traco, float azimuth)
 {
     float hx, hy;
@@ -70,7 +85,7 @@ float SemblanceCMP(ListaTracos *lista, float A, float B, float C, float t0, floa
         amostra = (int) (t/seg);
         //Se a janela da amostra cobre os dados sismicos
             //if(0.00000096154212769761 == C) printf("%d %d %d %d\n", amostra, w, amostra-w, amostra+w);
-        if(amostra - w >= 0 && amostra + w < lista->tracos[traco]->ns){
+        if(amostra - w >= 0 && amostra + w + 1 < lista->tracos[traco]->ns){
             //if(0.00000096154212769761 == C) printf("sim\n");
             //Para cada amostra dentro da janela
             for(j=0; j<janela; j++){
@@ -135,7 +150,7 @@ float Semblance(ListaTracos *lista, float A, float B, float C, float t0, float w
       //Calcular a amostra equivalente ao tempo calculado
       amostra = (int) (t/seg);
       //Se a janela da amostra cobre os dados sismicos
-      if(amostra - w >= 0 && amostra + w < lista->tracos[traco]->ns){
+      if(amostra - w >= 0 && amostra + w + 1 < lista->tracos[traco]->ns){
         //Para cada amostra dentro da janela
         for(j=0; j<janela; j++){
           k = amostra - w + j;
@@ -171,7 +186,7 @@ float Semblance(ListaTracos *lista, float A, float B, float C, float t0, float w
         //Calcular a amostra equivalente ao tempo calculado
         amostra = (int) (t/seg);
         //Se a janela da amostra cobre os dados sismicos
-        if(amostra - w >= 0 && amostra + w < lista->vizinhos[vizinho]->tracos[traco]->ns){
+        if(amostra - w >= 0 && amostra + w + 1 < lista->vizinhos[vizinho]->tracos[traco]->ns){
             //Para cada amostra dentro da janela
             for(j=0; j<janela; j++){
                 k = amostra - w + j;
@@ -254,12 +269,12 @@ float SemblanceWorker(TracosCDP **tracos, int tamanho, float A, float B, float C
       //if(amostra > 490) printf("CCC %d %.20lf %.20lf %.20lf %d\n", traco, t0, h, t, amostra);
       //if(amostra > 490) getchar();
       //Se a janela da amostra cobre os dados sismicos
-      if(amostra - w >= 0 && amostra + w < tracos[traco]->ns){
+      if(amostra - w >= 0 && amostra + w + 1 < tracos[traco]->ns){
         //Para cada amostra dentro da janela
         for(j=0; j<janela; j++){
           k = amostra - w + j;
           //Interpolacao linear entre as duas amostras
-          InterpolacaoLinear(&valor,tracos[traco]->dados[k],tracos[traco]->dados[k+1], t/seg-w+j, k, k+1);
+          InterpolacaoLinear(&valor,tracos[traco]->dados[k-tracos[traco]->inicio],tracos[traco]->dados[k+1-tracos[traco]->inicio], t/seg-w+j, k, k+1);
           //printf("%.20lf %.20lf %.20lf %d %.20lf %d\n",lista->vizinhos[vizinho]->tracos[traco]->dados[k], valor, lista->vizinhos[vizinho]->tracos[traco]->dados[k+1], k, t/seg-w+j, k+1);
           numerador[j] += valor;
           denominador += valor*valor;
@@ -33,6 +33,13 @@ float SemblanceWorker(TracosCDP **tracos, int tamanho, float A, float B, float C
 
 float SemblanceCMP(ListaTracos *lista, float A, float B, float C, float t0, float wind, float seg, float *pilha, float azimuth);
 
+/*
+ * Intervalo [inicio, fim) de amostras de um traco de metade de offset h
+ * que o semblance pode ler para t0 nas amostras [amostra, amostra+namostras)
+ * e C ate Cmax.
+ */
+void IntervaloAmostras(float h, float Cmax, int amostra, int namostras, float wind, float seg, int ns, int *inicio, int *fim);
+
 /*
  * Calcula a metade do offset.
  */
@@ -133,7 +133,7 @@ public:
         int r;
         int tracos, i;
         char cdpbuffer[6], amostrasbuffer[100];
-        char saida[101], saidaEmpilhado[104], saidaSemblance[104], saidaV[104];
+        char saida[101] = {0}, saidaEmpilhado[104] = {0}, saidaSemblance[104] = {0}, saidaV[104] = {0};
         FILE *arquivoEmpilhado, *arquivoSemblance, *arquivoV;
         Traco tracoSemblance, tracoEmpilhado, tracoV;
         parameters p(argc, argv, "[SM] ");
@@ -388,6 +388,12 @@ public:
 
         result.push(o);
 
+        //Liberar memoria alocada para a tarefa
+        for(i=0; i<tamanho; i++){
+            free(tracos[i]->dados);
+            free(tracos[i]);
+        }
+        free(tracos);
         free(Vvector);
         free(Cvector);
 
@@ -396,13 +402,7 @@ public:
 
     ~worker()
     {
-        int i, j;
-        for(i=0; i<tamanho; i++){
-            for(j=0; j<namostras; j++)
-                free(tracos[i]->dados);
-            free(tracos[i]);
-        }
-        free(tracos);
+        std::cout << "[WK] Worker destroyed." << std::endl;
     }
 };
 
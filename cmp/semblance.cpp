@@ -70,7 +70,7 @@ float SemblanceCMP(ListaTracos *lista, float A, float B, float C, float t0, floa
         amostra = (int) (t/seg);
         //Se a janela da amostra cobre os dados sismicos
             //if(0.00000096154212769761 == C) printf("%d %d %d %d\n", amostra, w, amostra-w, amostra+w);
-        if(amostra - w >= 0 && amostra + w < lista->tracos[traco]->ns){
+        if(amostra - w >= 0 && amostra + w + 1 < lista->tracos[traco]->ns){
             //if(0.00000096154212769761 == C) printf("sim\n");
             //Para cada amostra dentro da janela
             for(j=0; j<janela; j++){
@@ -135,7 +135,7 @@ float Semblance(ListaTracos *lista, float A, float B, float C, float t0, float w
       //Calcular a amostra equivalente ao tempo calculado
       amostra = (int) (t/seg);
       //Se a janela da amostra cobre os dados sismicos
-      if(amostra - w >= 0 && amostra + w < lista->tracos[traco]->ns){
+      if(amostra - w >= 0 && amostra + w + 1 < lista->tracos[traco]->ns){
         //Para cada amostra dentro da janela
         for(j=0; j<janela; j++){
           k = amostra - w + j;
@@ -171,7 +171,7 @@ float Semblance(ListaTracos *lista, float A, float B, float C, float t0, float w
         //Calcular a amostra equivalente ao tempo calculado
         amostra = (int) (t/seg);
         //Se a janela da amostra cobre os dados sismicos
-        if(amostra - w >= 0 && amostra + w < lista->vizinhos[vizinho]->tracos[traco]->ns){
+        if(amostra - w >= 0 && amostra + w + 1 < lista->vizinhos[vizinho]->tracos[traco]->ns){
             //Para cada amostra dentro da janela
             for(j=0; j<janela; j++){
                 k = amostra - w + j;
@@ -254,7 +254,7 @@ float SemblanceWorker(TracosCDP **tracos, int tamanho, float A, float B, float C
       //if(amostra > 490) printf("CCC %d %.20lf %.20lf %.20lf %d\n", traco, t0, h, t, amostra);
       //if(amostra > 490) getchar();
       //Se a janela da amostra cobre os dados sismicos
-      if(amostra - w >= 0 && amostra + w < tracos[traco]->ns){
+      if(amostra - w >= 0 && amostra + w + 1 < tracos[traco]->ns){
         //Para cada amostra dentro da janela
         for(j=0; j<janela; j++){
           k = amostra - w + j;
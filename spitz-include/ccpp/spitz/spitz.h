@@ -43,6 +43,13 @@ typedef const void* spitsctx_t;
 typedef int (*spitzrun_t)(int, const char**, const void*, spitssize_t, 
     const void**, spitssize_t*);
 
+/* Optional runner callbacks that start a job and return a handle without
+   waiting, and wait for the job of a handle returning its final result */
+
+typedef void* (*spitzsubmit_t)(int, const char**, const void*, spitssize_t);
+
+typedef int (*spitzwait_t)(void*, const void**, spitssize_t*);
+
 /* Pusher callback that performs result submission from a worker */
 
 typedef void (*spitspush_t)(const void*, spitssize_t, spitsctx_t);
@@ -51,6 +58,9 @@ typedef void (*spitspush_t)(const void*, spitssize_t, spitsctx_t);
 
 int spits_main(int argc, const char* argv[], spitzrun_t run);
 
+int spits_main_async(int argc, const char* argv[], spitzrun_t run,
+    spitzsubmit_t submit, spitzwait_t wait);
+
 /* Job Manager */
 
 void* spits_job_manager_new(int argc, const char *argv[],
@@ -84,6 +94,16 @@ int spits_committer_commit_job(void *user_data,
 
 void spits_committer_finalize(void *user_data);
 
+/* Optional: serialize the partial state of a committer that received part
+   of the results of a job, and merge such a state into another committer
+   of the same job, so results can be reduced by a tree of committers */
+
+int spits_committer_serialize_state(void *user_data,
+    spitspush_t push_state, spitsctx_t statectx);
+
+int spits_committer_merge_state(void *user_data,
+    const void* state, spitssize_t statesz);
+
 #ifdef __cplusplus
 }
 #endif
@@ -56,14 +56,82 @@ namespace spitz {
         }
     };
 
+    // Handle of a job started with runner::run_async
+    class job
+    {
+    private:
+        spitzwait_t waitf;
+        void* handle;
+        int r;
+        const void* pfinal_result;
+        spitssize_t pfinal_result_size;
+
+        friend class runner;
+
+    public:
+        job() : waitf(NULL), handle(NULL), r(-1), pfinal_result(NULL),
+            pfinal_result_size(0)
+        {
+        }
+
+        // Blocks until the job is committed, waiting again returns the
+        // same result
+        int wait(istream& final_result)
+        {
+            if (this->waitf) {
+                this->r = this->waitf(this->handle, &this->pfinal_result,
+                    &this->pfinal_result_size);
+                this->waitf = NULL;
+            }
+            final_result = istream(this->pfinal_result,
+                this->pfinal_result_size);
+            return this->r;
+        }
+
+        int wait()
+        {
+            istream r;
+            return wait(r);
+        }
+    };
+
     class runner
     {
     private:
         spitzrun_t runf;
+        spitzsubmit_t submitf;
+        spitzwait_t waitf;
 
     public:
-        runner(spitzrun_t runf) : runf(runf)
+        runner(spitzrun_t runf, spitzsubmit_t submitf = NULL,
+            spitzwait_t waitf = NULL) :
+            runf(runf), submitf(submitf), waitf(waitf)
+        {
+        }
+
+        // Starts a job without waiting for it. Runtimes without
+        // asynchronous submission run the job before returning.
+        job run_async(int argc, const char** argv) const
+        {
+            ostream j;
+            return run_async(argc, argv, j);
+        }
+
+        job run_async(int argc, const char** argv, ostream& jobinfo) const
         {
+            job j;
+            const void* pjobinfo = jobinfo.data();
+            spitssize_t pjobinfo_size = jobinfo.pos();
+            if (this->submitf && this->waitf) {
+                j.handle = this->submitf(argc, argv, pjobinfo,
+                    pjobinfo_size);
+                if (j.handle)
+                    j.waitf = this->waitf;
+            } else {
+                j.r = this->runf(argc, argv, pjobinfo, pjobinfo_size,
+                    &j.pfinal_result, &j.pfinal_result_size);
+            }
+            return j;
         }
 
         int run(int argc, const char** argv) const
@@ -131,6 +199,13 @@ namespace spitz {
             final_result.push(NULL, 0);
             return 0;
         }
+        // A committer that received only part of the results of a job can
+        // push its partial state, which is then merged into another
+        // committer of the same job. Only the committer that receives
+        // every state commits the job. Committers that do not support
+        // merging return a nonzero value.
+        virtual int serialize_state(const pusher&) { return -1; }
+        virtual int merge_state(istream&) { return -1; }
         virtual ~committer() { }
     };
 
@@ -149,9 +224,15 @@ extern spitz::factory *spitz_factory;
 #ifdef SPITZ_ENTRY_POINT
 
 extern "C" int spits_main(int argc, const char* argv[], spitzrun_t run)
+{
+    return spits_main_async(argc, argv, run, NULL, NULL);
+}
+
+extern "C" int spits_main_async(int argc, const char* argv[], spitzrun_t run,
+    spitzsubmit_t submit, spitzwait_t wait)
 {
     spitz::spitz_main *sm = spitz_factory->create_spitz_main();
-    spitz::runner runner(run);
+    spitz::runner runner(run, submit, wait);
 
     int r = sm->main(argc, argv, runner);
 
@@ -241,6 +322,26 @@ extern "C" int spits_committer_commit_job(void *user_data,
     return co->commit_job(final_result);
 }
 
+extern "C" int spits_committer_serialize_state(void *user_data,
+    spitspush_t push_state, spitsctx_t statectx)
+{
+    spitz::committer *co = reinterpret_cast
+        <spitz::committer*>(user_data);
+
+    spitz::pusher state(push_state, statectx);
+    return co->serialize_state(state);
+}
+
+extern "C" int spits_committer_merge_state(void *user_data,
+    const void* state, spitssize_t statesz)
+{
+    spitz::committer *co = reinterpret_cast
+        <spitz::committer*>(user_data);
+
+    spitz::istream sstate(state, statesz);
+    return co->merge_state(sstate);
+}
+
 extern "C" void spits_committer_finalize(void *user_data)
 {
     spitz::committer *co = reinterpret_cast
@@ -251,17 +352,320 @@ extern "C" void spits_committer_finalize(void *user_data)
 
 #ifdef SPITZ_SERIAL_DEBUG
 #include <vector>
+#include <deque>
+#include <map>
+#include <set>
+#include <string>
 #include <algorithm>
 #include <iostream>
 #include <cstdlib>
 #include <fstream>
 #include <sstream>
 #include <stdint.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <iomanip>
+#include <cstring>
+#include <ctime>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+// The debug runner executes the job manager, a pool of workers and the
+// committer inside the same process. The pool size is taken from the
+// SPITZ_DEBUG_WORKERS environment variable (default: one worker per
+// hardware thread) and the number of tasks waiting to be executed is
+// bounded by SPITZ_DEBUG_QUEUE (default: two tasks per worker).
+//
+// Each worker has its own deque of tasks and steals from the others when
+// it runs out of work. A job manager running under the debug runner may
+// also call push more than once from next_task: every push becomes an
+// independent task, so a large task can be pre-split into chunks that
+// idle workers are able to steal. The distributed runtime accepts a
+// single push per call.
+//
+// Setting SPITZ_DEBUG_MODE=process runs every worker instance in its own
+// forked process instead of a thread, for modules that are not safe to
+// run as many threads in the same address space. Tasks and results are
+// passed through ring buffers in POSIX shared memory whose size in MiB is
+// given by SPITZ_DEBUG_SHM (default: 16).
+//
+// The pool of workers is shared by every job. Jobs submitted with
+// run_async run concurrently, each one with its own job manager and
+// committer, and their tasks are interleaved in the pool.
+//
+// Tasks are assumed to be idempotent. When SPITZ_DEBUG_SPECULATE is set
+// to a percentile, a worker that finds no task after the job manager of
+// a job is done re-executes the task of that job that has been running
+// for the longest time, if that time is above the given percentile of
+// the task times of the job. The first copy to finish is committed and
+// the other one is discarded.
+//
+// SPITZ_DEBUG_COMMITTERS (default: 1) sets the number of committers of each
+// job. Results go to whichever committer is free, and at the end of the
+// job the committers are merged pairwise in a tree through their
+// serialize_state and merge_state methods before the first one commits
+// the job.
+
+typedef std::vector<uint8_t> spitz_debug_buffer;
+
+struct spitz_debug_job;
+
+struct spitz_debug_task
+{
+    int64_t tid;
+    spitz_debug_job* job;
+    spitz_debug_buffer data;
+};
+
+// Blocking FIFO with a fixed capacity, used to pass results from the
+// workers to the committer.
+template<typename T> class spitz_debug_queue
+{
+private:
+    std::mutex m;
+    std::condition_variable not_empty, not_full;
+    std::deque<T> q;
+    size_t capacity;
+    bool closed;
+
+public:
+    spitz_debug_queue(size_t capacity) :
+        capacity(capacity > 0 ? capacity : 1), closed(false)
+    {
+    }
+
+    void push(T& v)
+    {
+        std::unique_lock<std::mutex> lock(this->m);
+        while (this->q.size() >= this->capacity)
+            this->not_full.wait(lock);
+        this->q.push_back(std::move(v));
+        this->not_empty.notify_one();
+    }
+
+    bool pop(T& v)
+    {
+        std::unique_lock<std::mutex> lock(this->m);
+        while (this->q.empty() && !this->closed)
+            this->not_empty.wait(lock);
+        if (this->q.empty())
+            return false;
+        v = std::move(this->q.front());
+        this->q.pop_front();
+        this->not_full.notify_one();
+        return true;
+    }
+
+    void close()
+    {
+        std::unique_lock<std::mutex> lock(this->m);
+        this->closed = true;
+        this->not_empty.notify_all();
+    }
+};
+
+// Per-worker deques with work stealing. The owner takes tasks from the
+// front of its deque while thieves take them from the back of the most
+// loaded victim. The total number of queued tasks is bounded so the job
+// manager does not run too far ahead of the workers.
+class spitz_debug_scheduler
+{
+private:
+    struct slot
+    {
+        std::mutex m;
+        std::deque<spitz_debug_task> q;
+    };
+
+    std::vector<slot> slots;
+    std::mutex m;
+    std::condition_variable has_work, has_space;
+    size_t pending, capacity, next;
+    bool closed;
+
+    bool take(size_t w, spitz_debug_task& v, bool& stolen)
+    {
+        {
+            std::unique_lock<std::mutex> lock(this->slots[w].m);
+            if (!this->slots[w].q.empty()) {
+                v = std::move(this->slots[w].q.front());
+                this->slots[w].q.pop_front();
+                stolen = false;
+                return true;
+            }
+        }
+
+        // Pick the victim with the largest deque, the sizes are only a hint
+        size_t victim = w, most = 0;
+        for (size_t i = 0; i < this->slots.size(); i++) {
+            std::unique_lock<std::mutex> lock(this->slots[i].m);
+            if (this->slots[i].q.size() > most) {
+                most = this->slots[i].q.size();
+                victim = i;
+            }
+        }
+        if (victim == w)
+            return false;
+
+        std::unique_lock<std::mutex> lock(this->slots[victim].m);
+        if (this->slots[victim].q.empty())
+            return false;
+        v = std::move(this->slots[victim].q.back());
+        this->slots[victim].q.pop_back();
+        stolen = true;
+        return true;
+    }
+
+public:
+    spitz_debug_scheduler(size_t workers, size_t capacity) :
+        slots(workers > 0 ? workers : 1), pending(0),
+        capacity(capacity > 0 ? capacity : 1), next(0), closed(false)
+    {
+    }
+
+    void push(spitz_debug_task& v)
+    {
+        size_t w;
+        // The slot is reserved before the task is published, so that a
+        // worker never takes a task the counter does not know about yet
+        {
+            std::unique_lock<std::mutex> lock(this->m);
+            while (this->pending >= this->capacity)
+                this->has_space.wait(lock);
+            this->pending++;
+            w = this->next;
+            this->next = (this->next + 1) % this->slots.size();
+        }
+        {
+            std::unique_lock<std::mutex> lock(this->slots[w].m);
+            this->slots[w].q.push_back(std::move(v));
+        }
+        std::unique_lock<std::mutex> lock(this->m);
+        this->has_work.notify_all();
+    }
+
+    // Returns 1 with a task, -1 when the scheduler is closed and empty and
+    // 0 when no task arrived within the timeout, if one is given
+    int pop(size_t w, spitz_debug_task& v, bool& stolen,
+        double timeout = -1)
+    {
+        while (true) {
+            if (this->take(w, v, stolen)) {
+                std::unique_lock<std::mutex> lock(this->m);
+                this->pending--;
+                this->has_space.notify_one();
+                return 1;
+            }
+            std::unique_lock<std::mutex> lock(this->m);
+            if (this->pending == 0 && this->closed)
+                return -1;
+            // A pending task may be reserved but not yet in its deque, in
+            // which case the loop just tries again
+            if (this->pending == 0) {
+                if (timeout < 0)
+                    this->has_work.wait(lock);
+                else if (this->has_work.wait_for(lock,
+                    std::chrono::duration<double>(timeout)) ==
+                    std::cv_status::timeout)
+                    return 0;
+            }
+        }
+    }
+
+    void close()
+    {
+        std::unique_lock<std::mutex> lock(this->m);
+        this->closed = true;
+        this->has_work.notify_all();
+    }
+};
+
+typedef std::chrono::steady_clock spitz_debug_clock;
+
+static double spitz_debug_seconds(spitz_debug_clock::time_point a,
+    spitz_debug_clock::time_point b)
+{
+    return std::chrono::duration<double>(b - a).count();
+}
+
+// Execution statistics gathered by each worker thread without locking
+// and reported when the job ends
+struct spitz_debug_stats
+{
+    std::vector<double> durations;
+    double busy;
+    int64_t steals;
+    spitz_debug_clock::time_point last;
+
+    spitz_debug_stats() : busy(0), steals(0) { }
+};
+
+static void spitz_debug_report(int64_t jid,
+    const std::vector<spitz_debug_stats>& stats,
+    spitz_debug_clock::time_point start,
+    spitz_debug_clock::time_point generated,
+    spitz_debug_clock::time_point end)
+{
+    std::vector<double> d;
+    double wall = spitz_debug_seconds(start, end);
+    double idle = 0, tailidle = 0;
+    int64_t steals = 0;
+
+    for (size_t i = 0; i < stats.size(); i++) {
+        d.insert(d.end(), stats[i].durations.begin(),
+            stats[i].durations.end());
+        idle += wall - stats[i].busy;
+        steals += stats[i].steals;
+        if (!stats[i].durations.empty() && stats[i].last < end)
+            tailidle += spitz_debug_seconds(stats[i].last, end);
+    }
+
+    std::sort(d.begin(), d.end());
+
+    std::cerr << std::fixed << std::setprecision(3);
+    std::cerr << "[SPITZ] Job " << jid << " statistics: " << d.size()
+        << " tasks, " << steals << " stolen, " << wall << "s wall, "
+        << spitz_debug_seconds(generated, end) << "s after the last task "
+        "was generated." << std::endl;
+    if (!d.empty()) {
+        std::cerr << "[SPITZ] Task time p50 " << d[d.size() / 2]
+            << "s, p90 " << d[(d.size() * 9) / 10]
+            << "s, p99 " << d[(d.size() * 99) / 100]
+            << "s, max " << d.back() << "s." << std::endl;
+    }
+    std::cerr << "[SPITZ] Worker idle time " << idle << "s total ("
+        << (wall > 0 ? 100 * idle / (wall * stats.size()) : 0)
+        << "%), " << tailidle << "s waiting for the last tasks."
+        << std::endl;
+    std::cerr.unsetf(std::ios_base::floatfield);
+    std::cerr << std::setprecision(6);
+}
+
+static int spitz_debug_env(const char* name, int def)
+{
+    const char* v = getenv(name);
+    if (!v || !*v)
+        return def;
+    int n = atoi(v);
+    return n > 0 ? n : def;
+}
+
+static int spitz_debug_workers()
+{
+    int n = static_cast<int>(std::thread::hardware_concurrency());
+    return spitz_debug_env("SPITZ_DEBUG_WORKERS", n > 0 ? n : 1);
+}
 
 static void spitz_debug_pusher(const void* pdata,
     spitssize_t size, spitsctx_t ctx)
 {
-    std::vector<uint8_t>* v = reinterpret_cast<std::vector<uint8_t>*>
+    spitz_debug_buffer* v = reinterpret_cast<spitz_debug_buffer*>
       (const_cast<void*>(ctx));
 
     if (v->size() != 0) {
@@ -275,129 +679,886 @@ static void spitz_debug_pusher(const void* pdata,
         std::back_inserter(*v));
 }
 
-static int spitz_debug_runner(int argc, const char** argv,
-    const void* pjobinfo, spitssize_t jobinfosz,
-    const void** pfinal_result, spitssize_t* pfinal_resultsz)
+// Task pusher of the debug runner, each push is queued as a new task
+static void spitz_debug_task_pusher(const void* pdata,
+    spitssize_t size, spitsctx_t ctx)
 {
-    void* jm = spits_job_manager_new(argc, argv, pjobinfo, jobinfosz);
-    void* co = spits_committer_new(argc, argv, pjobinfo, jobinfosz);
-    void* wk = spits_worker_new(argc, argv);
+    std::vector<spitz_debug_buffer>* v = reinterpret_cast
+        <std::vector<spitz_debug_buffer>*>(const_cast<void*>(ctx));
 
-    static int64_t jid = 0;
-    int64_t tid = 0;
+    v->push_back(spitz_debug_buffer());
+    spitz_debug_pusher(pdata, size, &v->back());
+}
 
-    int r1 = 0, r2 = 0, r3 = 0;
+static void spitz_debug_dump(const char* kind, int64_t tid,
+    const spitz_debug_buffer& data)
+{
+    std::cerr << "[SPITZ] Generating " << kind << " dump for task "
+        << tid << "..." << std::endl;
+    std::stringstream ss;
+    ss << kind << "-" << tid << ".dump";
+    std::ofstream file(ss.str().c_str(), std::ofstream::binary);
+    if (data.size() > 1)
+        file.write(reinterpret_cast<const char*>(data.data()+1),
+            data.size()-1);
+    file.close();
+    std::cerr << "[SPITZ] " << kind << " dump generated as " << ss.str() <<
+        " [" << (data.size() > 1 ? data.size()-1 : 0) << " bytes]. "
+        << std::endl;
+}
 
-    std::vector<int8_t> task;
-    std::vector<int8_t> result;
-    std::vector<int8_t>* final_result = new std::vector<int8_t>();
+// A job submitted to the debug runner. Its tasks are executed by the
+// shared pool while a thread of its own generates them and another one
+// commits the results.
+struct spitz_debug_job
+{
+    int64_t jid;
+    std::vector<std::string> args;
+    std::vector<const char*> argv;
+    spitz_debug_buffer jobinfo;
+
+    std::thread thread;
+    std::mutex joining;
+    bool joined;
+    int r;
+    spitz_debug_buffer final_result;
+
+    // Tasks not yet executed and whether the job manager is done, the
+    // results queue is closed when both say the job is over
+    std::mutex m;
+    int64_t outstanding;
+    bool generated;
+    spitz_debug_queue<spitz_debug_task> results;
+    std::vector<spitz_debug_stats> stats;
+
+    // Tasks being executed, the data belongs to the worker thread running
+    // the first copy, and executions still running, including duplicates
+    struct running_task
+    {
+        const spitz_debug_buffer* data;
+        spitz_debug_clock::time_point start;
+        bool speculated;
+    };
+    std::map<int64_t, running_task> inflight;
+    std::vector<double> durations;
+    std::condition_variable idle;
+    int64_t running;
+    int64_t speculated, speculation_won, speculation_lost;
+
+    spitz_debug_job(int64_t jid, int argc, const char** argv,
+        const void* pjobinfo, spitssize_t jobinfosz, size_t workers,
+        size_t capacity) :
+        jid(jid), args(argv, argv + argc),
+        jobinfo(reinterpret_cast<const uint8_t*>(pjobinfo),
+            reinterpret_cast<const uint8_t*>(pjobinfo) + jobinfosz),
+        joined(false), r(0), outstanding(0), generated(false),
+        results(capacity), stats(workers), running(0), speculated(0),
+        speculation_won(0), speculation_lost(0)
+    {
+        for (size_t i = 0; i < this->args.size(); i++)
+            this->argv.push_back(this->args[i].c_str());
+    }
 
-    while(true) {
-        task.clear();
-        std::cerr << "[SPITZ] Generating task " << tid << "..." << std::endl;
-        if(!spits_job_manager_next_task(jm, spitz_debug_pusher, &task))
+    int argc() const { return static_cast<int>(this->argv.size()); }
+
+    void started(int64_t tid, const spitz_debug_buffer* data)
+    {
+        std::unique_lock<std::mutex> lock(this->m);
+        running_task t = { data, spitz_debug_clock::now(), false };
+        this->inflight[tid] = t;
+        this->running++;
+    }
+
+    // Called after every execution, returns whether it was the first
+    // copy of the task to finish, whose result must be committed
+    bool finished(int64_t tid, bool duplicate, double duration)
+    {
+        std::unique_lock<std::mutex> lock(this->m);
+        std::map<int64_t, running_task>::iterator it =
+            this->inflight.find(tid);
+        bool first = it != this->inflight.end();
+        if (first) {
+            this->inflight.erase(it);
+            this->durations.push_back(duration);
+            if (duplicate)
+                this->speculation_won++;
+        } else if (duplicate) {
+            this->speculation_lost++;
+        }
+        if (--this->running == 0)
+            this->idle.notify_all();
+        return first;
+    }
+
+    // The data of the first copy is used before the lock is released, so
+    // the worker thread that owns it cannot reuse it meanwhile
+    bool speculate(double percentile, spitz_debug_task& task)
+    {
+        std::unique_lock<std::mutex> lock(this->m);
+        if (!this->generated || this->durations.size() < 3)
+            return false;
+
+        std::vector<double> d(this->durations);
+        size_t k = std::min(d.size() - 1, static_cast<size_t>(
+            d.size() * percentile / 100));
+        std::nth_element(d.begin(), d.begin() + k, d.end());
+        double threshold = d[k];
+
+        spitz_debug_clock::time_point now = spitz_debug_clock::now();
+        std::map<int64_t, running_task>::iterator it, best =
+            this->inflight.end();
+        double longest = threshold;
+        for (it = this->inflight.begin(); it != this->inflight.end(); it++) {
+            double t = spitz_debug_seconds(it->second.start, now);
+            if (!it->second.speculated && t > longest) {
+                longest = t;
+                best = it;
+            }
+        }
+        if (best == this->inflight.end())
+            return false;
+
+        best->second.speculated = true;
+        task.tid = best->first;
+        task.job = this;
+        task.data = *best->second.data;
+        this->speculated++;
+        this->running++;
+        return true;
+    }
+
+    void executed()
+    {
+        std::unique_lock<std::mutex> lock(this->m);
+        if (--this->outstanding == 0 && this->generated)
+            this->results.close();
+    }
+};
+
+// Executes the tasks taken by one of the worker threads of the pool. An
+// executor keeps one worker instance per job, created on the first task
+// of the job and finalized when the job ends.
+class spitz_debug_executor
+{
+public:
+    virtual int run(spitz_debug_job* job, const spitz_debug_buffer& task,
+        spitz_debug_buffer& result) = 0;
+    virtual void finish(spitz_debug_job* job) = 0;
+    virtual ~spitz_debug_executor() { }
+};
+
+// Runs the tasks in the worker thread itself
+class spitz_debug_thread_executor : public spitz_debug_executor
+{
+private:
+    std::mutex m;
+    std::map<int64_t, void*> wk;
+
+public:
+    int run(spitz_debug_job* job, const spitz_debug_buffer& task,
+        spitz_debug_buffer& result)
+    {
+        void* w;
+        {
+            std::unique_lock<std::mutex> lock(this->m);
+            std::map<int64_t, void*>::iterator it = this->wk.find(job->jid);
+            if (it == this->wk.end())
+                it = this->wk.insert(std::make_pair(job->jid,
+                    spits_worker_new(job->argc(), job->argv.data()))).first;
+            w = it->second;
+        }
+        return spits_worker_run(w, task.data()+1, task.size()-1,
+            spitz_debug_pusher, &result);
+    }
+
+    void finish(spitz_debug_job* job)
+    {
+        void* w;
+        {
+            std::unique_lock<std::mutex> lock(this->m);
+            std::map<int64_t, void*>::iterator it = this->wk.find(job->jid);
+            if (it == this->wk.end())
+                return;
+            w = it->second;
+            this->wk.erase(it);
+        }
+        spits_worker_finalize(w);
+    }
+
+    ~spitz_debug_thread_executor()
+    {
+        std::map<int64_t, void*>::iterator it;
+        for (it = this->wk.begin(); it != this->wk.end(); it++)
+            spits_worker_finalize(it->second);
+    }
+};
+
+// Single-producer single-consumer byte ring placed in shared memory. The
+// data area follows the header. Messages larger than the ring are
+// streamed through it because both sides copy concurrently.
+struct spitz_debug_ring
+{
+    pthread_mutex_t m;
+    pthread_cond_t readable, writable;
+    uint64_t head, tail, size;
+
+    char* buffer() { return reinterpret_cast<char*>(this + 1); }
+};
+
+static spitz_debug_ring* spitz_debug_ring_new(size_t size)
+{
+    static int64_t rid = 0;
+    std::stringstream ss;
+    ss << "/spitz-debug-" << getpid() << "-" << rid++;
+
+    size_t total = sizeof(spitz_debug_ring) + size;
+    int fd = shm_open(ss.str().c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0 || ftruncate(fd, total) != 0) {
+        std::cerr << "[SPITZ] Failed to create shared memory "
+            << ss.str() << "!" << std::endl;
+        exit(1);
+    }
+    void* p = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    // The mapping is inherited by the worker process, the name is useless
+    shm_unlink(ss.str().c_str());
+    if (p == MAP_FAILED) {
+        std::cerr << "[SPITZ] Failed to map shared memory "
+            << ss.str() << "!" << std::endl;
+        exit(1);
+    }
+
+    spitz_debug_ring* r = reinterpret_cast<spitz_debug_ring*>(p);
+    pthread_mutexattr_t ma;
+    pthread_mutexattr_init(&ma);
+    pthread_mutexattr_setpshared(&ma, PTHREAD_PROCESS_SHARED);
+    pthread_mutex_init(&r->m, &ma);
+    pthread_mutexattr_destroy(&ma);
+    pthread_condattr_t ca;
+    pthread_condattr_init(&ca);
+    pthread_condattr_setpshared(&ca, PTHREAD_PROCESS_SHARED);
+    pthread_cond_init(&r->readable, &ca);
+    pthread_cond_init(&r->writable, &ca);
+    pthread_condattr_destroy(&ca);
+    r->head = r->tail = 0;
+    r->size = size;
+    return r;
+}
+
+static void spitz_debug_ring_delete(spitz_debug_ring* r)
+{
+    munmap(r, sizeof(spitz_debug_ring) + r->size);
+}
+
+// The runner watches its children and the children watch their parent,
+// so that no side blocks forever on a ring when the other one dies
+static bool spitz_debug_alive(pid_t peer, bool child)
+{
+    if (child)
+        return getppid() == peer;
+    int status;
+    return waitpid(peer, &status, WNOHANG) == 0;
+}
+
+static bool spitz_debug_ring_transfer(spitz_debug_ring* r, void* p,
+    size_t n, bool write, pid_t peer, bool child)
+{
+    char* c = reinterpret_cast<char*>(p);
+
+    pthread_mutex_lock(&r->m);
+    while (n > 0) {
+        uint64_t used = r->head - r->tail;
+        uint64_t avail = write ? r->size - used : used;
+        if (avail == 0) {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += 100000000;
+            if (ts.tv_nsec >= 1000000000) {
+                ts.tv_sec += 1;
+                ts.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(write ? &r->writable : &r->readable,
+                &r->m, &ts);
+            if (!spitz_debug_alive(peer, child)) {
+                pthread_mutex_unlock(&r->m);
+                return false;
+            }
+            continue;
+        }
+        uint64_t pos = (write ? r->head : r->tail) % r->size;
+        size_t k = std::min<uint64_t>(std::min<uint64_t>(n, avail),
+            r->size - pos);
+        pthread_mutex_unlock(&r->m);
+
+        // Only one side touches each region, so the copy needs no lock
+        if (write)
+            memcpy(r->buffer() + pos, c, k);
+        else
+            memcpy(c, r->buffer() + pos, k);
+
+        pthread_mutex_lock(&r->m);
+        if (write) {
+            r->head += k;
+            pthread_cond_signal(&r->readable);
+        } else {
+            r->tail += k;
+            pthread_cond_signal(&r->writable);
+        }
+        c += k;
+        n -= k;
+    }
+    pthread_mutex_unlock(&r->m);
+    return true;
+}
+
+static void spitz_debug_flush()
+{
+    std::cout.flush();
+    std::cerr.flush();
+    fflush(NULL);
+}
+
+// Messages sent to a forked worker process start with three 64-bit
+// words: kind, job id and payload size
+enum spitz_debug_message
+{
+    SPITZ_DEBUG_EXIT = 0,
+    SPITZ_DEBUG_TASK = 1,
+    SPITZ_DEBUG_START = 2,
+    SPITZ_DEBUG_FINISH = 3
+};
+
+// Worker instance of a job inside a forked process, the arguments are
+// received as a sequence of null-terminated strings
+struct spitz_debug_process_worker
+{
+    spitz_debug_buffer args;
+    std::vector<const char*> argv;
+    void* wk;
+
+    spitz_debug_process_worker(spitz_debug_buffer& a) : wk(NULL)
+    {
+        this->args.swap(a);
+        for (size_t i = 0; i < this->args.size(); i += strlen(
+            reinterpret_cast<const char*>(this->args.data() + i)) + 1)
+            this->argv.push_back(reinterpret_cast<const char*>(
+                this->args.data() + i));
+        this->wk = spits_worker_new(static_cast<int>(this->argv.size()),
+            this->argv.data());
+    }
+
+    ~spitz_debug_process_worker()
+    {
+        spits_worker_finalize(this->wk);
+    }
+};
+
+// Main loop of a forked worker process. Results are sent back with two
+// 64-bit words: return code and result size.
+static void spitz_debug_process_main(spitz_debug_ring* tasks,
+    spitz_debug_ring* results, pid_t parent)
+{
+    std::map<int64_t, spitz_debug_process_worker*> wk;
+    std::map<int64_t, spitz_debug_process_worker*>::iterator it;
+    spitz_debug_buffer payload, result;
+    int64_t h[3], rh[2];
+
+    while (spitz_debug_ring_transfer(tasks, h, sizeof(h), false,
+        parent, true) && h[0] != SPITZ_DEBUG_EXIT) {
+        payload.resize(h[2]);
+        if (!spitz_debug_ring_transfer(tasks, payload.data(),
+            payload.size(), false, parent, true))
             break;
 
-        if (task.size() == 0) {
-            std::cerr << "[SPITZ] Task manager didn't push a task!"
-                << std::endl;
-            exit(1);
+        if (h[0] == SPITZ_DEBUG_START) {
+            wk[h[1]] = new spitz_debug_process_worker(payload);
+            continue;
+        }
+
+        it = wk.find(h[1]);
+        if (h[0] == SPITZ_DEBUG_FINISH) {
+            if (it != wk.end()) {
+                delete it->second;
+                wk.erase(it);
+            }
+            continue;
         }
 
         result.clear();
-        std::cerr << "[SPITZ] Executing task " << tid << "..." << std::endl;
-        r1 = spits_worker_run(wk, task.data()+1, task.size()-1,
-            spitz_debug_pusher, &result);
+        rh[0] = it == wk.end() ? -1 : spits_worker_run(it->second->wk,
+            payload.data()+1, payload.size()-1, spitz_debug_pusher,
+            &result);
+        rh[1] = result.size();
+
+        if (!spitz_debug_ring_transfer(results, rh, sizeof(rh), true,
+            parent, true) || !spitz_debug_ring_transfer(results,
+            result.data(), result.size(), true, parent, true))
+            break;
+    }
+
+    for (it = wk.begin(); it != wk.end(); it++)
+        delete it->second;
+    spitz_debug_flush();
+    _exit(0);
+}
+
+// Runs the tasks in a forked process that owns the worker instances. The
+// lock keeps the rings single-producer when a job finishes while the
+// pool thread is running a task of another job.
+class spitz_debug_process_executor : public spitz_debug_executor
+{
+private:
+    spitz_debug_ring *tasks, *results;
+    pid_t pid;
+    std::mutex m;
+    std::set<int64_t> started;
+
+    void died()
+    {
+        std::cerr << "[SPITZ] Worker process " << pid << " died!"
+            << std::endl;
+        exit(1);
+    }
 
-        if (r1 != 0) {
-            std::cerr << "[SPITZ] Task " << tid << " failed to execute!"
+    void send(int64_t kind, int64_t jid, const void* p, size_t n)
+    {
+        int64_t h[3] = { kind, jid, static_cast<int64_t>(n) };
+        if (!spitz_debug_ring_transfer(tasks, h, sizeof(h), true,
+            pid, false) || !spitz_debug_ring_transfer(tasks,
+            const_cast<void*>(p), n, true, pid, false))
+            died();
+    }
+
+public:
+    spitz_debug_process_executor(size_t ringsz) :
+        tasks(spitz_debug_ring_new(ringsz)),
+        results(spitz_debug_ring_new(ringsz))
+    {
+        pid_t parent = getpid();
+        spitz_debug_flush();
+        pid = fork();
+        if (pid < 0) {
+            std::cerr << "[SPITZ] Failed to fork a worker process!"
                 << std::endl;
-            goto dump_task_and_exit;
+            exit(1);
         }
+        if (pid == 0)
+            spitz_debug_process_main(tasks, results, parent);
+    }
 
-        if (task.size() == 0) {
-            std::cerr << "[SPITZ] Worker didn't push a result!"
-                << std::endl;
-            goto dump_task_and_exit;
+    int run(spitz_debug_job* job, const spitz_debug_buffer& task,
+        spitz_debug_buffer& result)
+    {
+        std::unique_lock<std::mutex> lock(this->m);
+        int64_t h[2];
+
+        if (this->started.insert(job->jid).second) {
+            spitz_debug_buffer args;
+            for (size_t i = 0; i < job->args.size(); i++)
+                args.insert(args.end(), job->args[i].c_str(),
+                    job->args[i].c_str() + job->args[i].size() + 1);
+            send(SPITZ_DEBUG_START, job->jid, args.data(), args.size());
         }
+        send(SPITZ_DEBUG_TASK, job->jid, task.data(), task.size());
+
+        if (!spitz_debug_ring_transfer(results, h, sizeof(h), false,
+            pid, false))
+            died();
+        result.resize(h[1]);
+        if (!spitz_debug_ring_transfer(results, result.data(),
+            result.size(), false, pid, false))
+            died();
 
-        std::cerr << "[SPITZ] Committing task " << tid << "..." << std::endl;
-        r2 = spits_committer_commit_pit(co, result.data()+1, result.size()-1);
+        return static_cast<int>(h[0]);
+    }
 
-        if (r2 != 0) {
-            std::cerr << "[SPITZ] Task " << tid << " failed to commit!"
+    void finish(spitz_debug_job* job)
+    {
+        std::unique_lock<std::mutex> lock(this->m);
+        if (this->started.erase(job->jid))
+            send(SPITZ_DEBUG_FINISH, job->jid, NULL, 0);
+    }
+
+    ~spitz_debug_process_executor()
+    {
+        int status;
+        send(SPITZ_DEBUG_EXIT, 0, NULL, 0);
+        waitpid(pid, &status, 0);
+        spitz_debug_ring_delete(tasks);
+        spitz_debug_ring_delete(results);
+    }
+};
+
+// Pool of worker threads shared by every job of the debug runner. It is
+// created on the first job, so worker processes are forked before any
+// thread of the runner is started, and lives until the program ends.
+class spitz_debug_pool
+{
+private:
+    std::vector<spitz_debug_executor*> wk;
+    spitz_debug_scheduler tasks;
+    std::vector<std::thread> threads;
+    bool processes;
+    double percentile;
+
+    // Jobs whose job manager is done and may have tasks to speculate on
+    std::mutex m;
+    std::set<spitz_debug_job*> ending;
+
+    bool speculate(spitz_debug_task& task)
+    {
+        std::unique_lock<std::mutex> lock(this->m);
+        std::set<spitz_debug_job*>::iterator it;
+        for (it = this->ending.begin(); it != this->ending.end(); it++)
+            if ((*it)->speculate(this->percentile, task))
+                return true;
+        return false;
+    }
+
+    static void loop(spitz_debug_pool* pool, size_t w)
+    {
+        spitz_debug_task task, result;
+        bool stolen, duplicate;
+        int got;
+
+        while (true) {
+            got = pool->tasks.pop(w, task, stolen,
+                pool->percentile > 0 ? 0.01 : -1);
+            if (got < 0)
+                break;
+            duplicate = got == 0;
+            if (duplicate && !pool->speculate(task))
+                continue;
+
+            spitz_debug_job* job = task.job;
+            spitz_debug_stats* stats = &job->stats[w];
+            result.tid = task.tid;
+            result.job = job;
+            result.data.clear();
+            if (stolen && !duplicate)
+                stats->steals++;
+            if (!duplicate)
+                job->started(task.tid, &task.data);
+            std::cerr << "[SPITZ] Executing " << (duplicate ?
+                "duplicate of task " : "task ") << task.tid
+                << " of job " << job->jid << "..." << std::endl;
+            spitz_debug_clock::time_point t0 = spitz_debug_clock::now();
+            int r = pool->wk[w]->run(job, task.data, result.data);
+            spitz_debug_clock::time_point t1 = spitz_debug_clock::now();
+
+            if (r != 0) {
+                std::cerr << "[SPITZ] Task " << task.tid
+                    << " failed to execute!" << std::endl;
+                spitz_debug_dump("task", task.tid, task.data);
+                exit(1);
+            }
+
+            if (result.data.size() == 0) {
+                std::cerr << "[SPITZ] Worker didn't push a result!"
+                    << std::endl;
+                spitz_debug_dump("task", task.tid, task.data);
+                exit(1);
+            }
+
+            stats->durations.push_back(spitz_debug_seconds(t0, t1));
+            stats->busy += stats->durations.back();
+            stats->last = t1;
+
+            if (job->finished(task.tid, duplicate,
+                stats->durations.back())) {
+                job->results.push(result);
+                job->executed();
+            } else {
+                std::cerr << "[SPITZ] Discarding the second result of task "
+                    << task.tid << " of job " << job->jid << "." << std::endl;
+            }
+        }
+    }
+
+public:
+    spitz_debug_pool(int nw, int nq, bool processes, size_t ringsz,
+        double percentile) :
+        wk(nw), tasks(nw, nq), processes(processes), percentile(percentile)
+    {
+        for (int i = 0; i < nw; i++) {
+            if (processes)
+                wk[i] = new spitz_debug_process_executor(ringsz);
+            else
+                wk[i] = new spitz_debug_thread_executor();
+        }
+        for (int i = 0; i < nw; i++)
+            threads.push_back(std::thread(loop, this, i));
+    }
+
+    size_t size() const { return this->wk.size(); }
+
+    bool uses_processes() const { return this->processes; }
+
+    void push(spitz_debug_task& task)
+    {
+        this->tasks.push(task);
+    }
+
+    // Called when the job manager of the job is done
+    void generated(spitz_debug_job* job)
+    {
+        std::unique_lock<std::mutex> lock(this->m);
+        this->ending.insert(job);
+    }
+
+    // Called once all the tasks of the job were committed, waits for the
+    // duplicates that are still running
+    void drain(spitz_debug_job* job)
+    {
+        {
+            std::unique_lock<std::mutex> lock(this->m);
+            this->ending.erase(job);
+        }
+        std::unique_lock<std::mutex> lock(job->m);
+        while (job->running > 0)
+            job->idle.wait(lock);
+    }
+
+    void finish(spitz_debug_job* job)
+    {
+        for (size_t i = 0; i < this->wk.size(); i++)
+            this->wk[i]->finish(job);
+    }
+
+    ~spitz_debug_pool()
+    {
+        this->tasks.close();
+        for (size_t i = 0; i < this->threads.size(); i++)
+            this->threads[i].join();
+        for (size_t i = 0; i < this->wk.size(); i++)
+            delete this->wk[i];
+    }
+};
+
+static std::mutex spitz_debug_jobs_lock;
+static std::vector<spitz_debug_job*> spitz_debug_jobs;
+static spitz_debug_pool* spitz_debug_the_pool = NULL;
+
+// The committer is created by its own thread, so that the job manager
+// starts generating tasks without waiting for it
+static void spitz_debug_committer_loop(void** pco, spitz_debug_job* job)
+{
+    spitz_debug_task result;
+    void* co = *pco = spits_committer_new(job->argc(), job->argv.data(),
+        job->jobinfo.data(), job->jobinfo.size());
+
+    while (job->results.pop(result)) {
+        std::cerr << "[SPITZ] Committing task " << result.tid << " of job "
+            << job->jid << "..." << std::endl;
+        int r = spits_committer_commit_pit(co, result.data.data()+1,
+            result.data.size()-1);
+
+        if (r != 0) {
+            std::cerr << "[SPITZ] Task " << result.tid
+                << " failed to commit!" << std::endl;
+            spitz_debug_dump("result", result.tid, result.data);
+            exit(1);
+        }
+    }
+}
+
+// Merges the committers of a job into the first one, pairwise at each level
+// of a binary tree, finalizing the committers that were merged
+static void spitz_debug_merge(spitz_debug_job* job, std::vector<void*>& co)
+{
+    spitz_debug_buffer state;
+
+    for (size_t step = 1; step < co.size(); step *= 2) {
+        for (size_t i = 0; i + step < co.size(); i += 2 * step) {
+            std::cerr << "[SPITZ] Merging committer " << i + step
+                << " into committer " << i << " of job " << job->jid
+                << "..." << std::endl;
+            state.clear();
+            if (spits_committer_serialize_state(co[i + step],
+                spitz_debug_pusher, &state) != 0 ||
+                spits_committer_merge_state(co[i], state.size() > 0 ?
+                state.data() + 1 : NULL, state.size() > 0 ?
+                state.size() - 1 : 0) != 0) {
+                std::cerr << "[SPITZ] Committers of job " << job->jid
+                    << " cannot be merged!" << std::endl;
+                exit(1);
+            }
+            spits_committer_finalize(co[i + step]);
+        }
+    }
+    co.resize(1);
+}
+
+static void spitz_debug_job_main(spitz_debug_pool* pool,
+    spitz_debug_job* job)
+{
+    const void* pjobinfo = job->jobinfo.data();
+    spitssize_t jobinfosz = job->jobinfo.size();
+    void* jm = spits_job_manager_new(job->argc(), job->argv.data(),
+        pjobinfo, jobinfosz);
+    std::vector<void*> co(spitz_debug_env("SPITZ_DEBUG_COMMITTERS", 1));
+
+    int64_t tid = 0;
+    std::vector<spitz_debug_buffer> chunks;
+    spitz_debug_task task;
+
+    std::cerr << "[SPITZ] Running job " << job->jid << " with " <<
+        pool->size() << " worker " << (pool->uses_processes() ?
+        "process(es)" : "thread(s)") << "..." << std::endl;
+
+    spitz_debug_clock::time_point start = spitz_debug_clock::now();
+
+    std::vector<std::thread> committers;
+    for (size_t i = 0; i < co.size(); i++)
+        committers.push_back(std::thread(spitz_debug_committer_loop,
+            &co[i], job));
+
+    while(true) {
+        chunks.clear();
+        std::cerr << "[SPITZ] Generating task " << tid << " of job "
+            << job->jid << "..." << std::endl;
+        if(!spits_job_manager_next_task(jm, spitz_debug_task_pusher, &chunks))
+            break;
+
+        if (chunks.size() == 0) {
+            std::cerr << "[SPITZ] Task manager didn't push a task!"
                 << std::endl;
-            goto dump_result_and_exit;
+            exit(1);
+        }
+
+        for (size_t i = 0; i < chunks.size(); i++) {
+            task.tid = tid++;
+            task.job = job;
+            task.data.swap(chunks[i]);
+            {
+                std::unique_lock<std::mutex> lock(job->m);
+                job->outstanding++;
+            }
+            pool->push(task);
         }
-        tid++;
     }
-    std::cerr << "[SPITZ] Finished processing tasks." << std::endl;
+    std::cerr << "[SPITZ] Finished generating tasks of job " << job->jid
+        << "." << std::endl;
 
-    final_result->clear();
-    std::cerr << "[SPITZ] Committing job " << jid << "..." << std::endl;
-    r3 = spits_committer_commit_job(co, spitz_debug_pusher, final_result);
+    spitz_debug_clock::time_point generated = spitz_debug_clock::now();
 
-    if (r3 != 0) {
-        std::cerr << "[SPITZ] Job " << jid << " failed to commit!"
+    {
+        std::unique_lock<std::mutex> lock(job->m);
+        job->generated = true;
+        if (job->outstanding == 0)
+            job->results.close();
+    }
+    pool->generated(job);
+    for (size_t i = 0; i < committers.size(); i++)
+        committers[i].join();
+    pool->drain(job);
+    spitz_debug_merge(job, co);
+    std::cerr << "[SPITZ] Finished processing tasks of job " << job->jid
+        << "." << std::endl;
+
+    spitz_debug_report(job->jid, job->stats, start, generated,
+        spitz_debug_clock::now());
+    if (job->speculated > 0)
+        std::cerr << "[SPITZ] Speculation: " << job->speculated
+            << " duplicate(s), " << job->speculation_won << " finished "
+            "first, " << job->speculation_lost << " discarded." << std::endl;
+
+    std::cerr << "[SPITZ] Committing job " << job->jid << "..." << std::endl;
+    job->r = spits_committer_commit_job(co[0], spitz_debug_pusher,
+        &job->final_result);
+
+    if (job->r != 0) {
+        std::cerr << "[SPITZ] Job " << job->jid << " failed to commit!"
             << std::endl;
         exit(1);
     }
 
-    if (final_result->size() <= 1) {
-        *pfinal_result = NULL;
-        *pfinal_resultsz = 0;
-    } else {
-        *pfinal_result = final_result->data()+1;
-        *pfinal_resultsz = final_result->size()-1;
-    }
-
     std::cerr << "[SPITZ] Finalizing task manager..." << std::endl;
     spits_job_manager_finalize(jm);
 
     std::cerr << "[SPITZ] Finalizing committer..." << std::endl;
-    spits_committer_finalize(co);
+    spits_committer_finalize(co[0]);
 
-    std::cerr << "[SPITZ] Finalizing worker..." << std::endl;
-    spits_worker_finalize(wk);
+    std::cerr << "[SPITZ] Finalizing workers..." << std::endl;
+    pool->finish(job);
 
-    std::cerr << "[SPITZ] Job " << jid << " completed." << std::endl;
-    jid++;
+    std::cerr << "[SPITZ] Job " << job->jid << " completed." << std::endl;
+}
+
+// Starts a job and returns immediately, the job is a handle for
+// spitz_debug_wait
+static void* spitz_debug_submit(int argc, const char** argv,
+    const void* pjobinfo, spitssize_t jobinfosz)
+{
+    std::unique_lock<std::mutex> lock(spitz_debug_jobs_lock);
+
+    if (!spitz_debug_the_pool) {
+        int nw = spitz_debug_workers();
+        int nq = spitz_debug_env("SPITZ_DEBUG_QUEUE", 2 * nw);
+        const char* mode = getenv("SPITZ_DEBUG_MODE");
+        size_t ringsz = static_cast<size_t>(
+            spitz_debug_env("SPITZ_DEBUG_SHM", 16)) << 20;
+        const char* speculate = getenv("SPITZ_DEBUG_SPECULATE");
+        spitz_debug_the_pool = new spitz_debug_pool(nw, nq,
+            mode && std::string(mode) == "process", ringsz,
+            speculate ? atof(speculate) : 0);
+    }
+
+    int nq = spitz_debug_env("SPITZ_DEBUG_QUEUE",
+        2 * static_cast<int>(spitz_debug_the_pool->size()));
+    spitz_debug_job* job = new spitz_debug_job(spitz_debug_jobs.size(),
+        argc, argv, pjobinfo, jobinfosz, spitz_debug_the_pool->size(), nq);
+    spitz_debug_jobs.push_back(job);
+    job->thread = std::thread(spitz_debug_job_main, spitz_debug_the_pool,
+        job);
+    return job;
+}
 
-    return 0;
+// Waits for a job to be committed. The final result stays valid until
+// the program ends.
+static int spitz_debug_wait(void* handle, const void** pfinal_result,
+    spitssize_t* pfinal_resultsz)
+{
+    spitz_debug_job* job = reinterpret_cast<spitz_debug_job*>(handle);
 
-dump_result_and_exit:
     {
-        std::cerr << "[SPITZ] Generating result dump for task "
-            << tid << "..." << std::endl;
-        std::stringstream ss;
-        ss << "result-" << tid << ".dump";
-        std::ofstream resfile(ss.str().c_str(), std::ofstream::binary);
-        resfile.write(reinterpret_cast<const char*>(result.data()+1),
-            result.size()-1);
-        resfile.close();
-        std::cerr << "[SPITZ] Result dump generated as " << ss.str() <<
-            " [" << (result.size()-1) << " bytes]. " << std::endl;
+        std::unique_lock<std::mutex> lock(job->joining);
+        if (!job->joined) {
+            job->thread.join();
+            job->joined = true;
+        }
     }
-dump_task_and_exit:
-    {
-        std::cerr << "[SPITZ] Generating task dump for task "
-            << tid << "..." << std::endl;
-        std::stringstream ss;
-        ss << "task-" << tid << ".dump";
-        std::ofstream taskfile(ss.str().c_str(), std::ofstream::binary);
-        taskfile.write(reinterpret_cast<const char*>(task.data()+1),
-            task.size()-1);
-        taskfile.close();
-        std::cerr << "[SPITZ] Task dump generated as " << ss.str() <<
-            " [" << (task.size()-1) << " bytes]. " << std::endl;
+
+    if (job->final_result.size() <= 1) {
+        *pfinal_result = NULL;
+        *pfinal_resultsz = 0;
+    } else {
+        *pfinal_result = job->final_result.data()+1;
+        *pfinal_resultsz = job->final_result.size()-1;
     }
-    exit(1);
+    return job->r;
+}
+
+static int spitz_debug_runner(int argc, const char** argv,
+    const void* pjobinfo, spitssize_t jobinfosz,
+    const void** pfinal_result, spitssize_t* pfinal_resultsz)
+{
+    return spitz_debug_wait(spitz_debug_submit(argc, argv, pjobinfo,
+        jobinfosz), pfinal_result, pfinal_resultsz);
 }
 
 int main(int argc, const char** argv)
 {
     std::cerr << "[SPITZ] Entering debug mode..." << std::endl;
-    spits_main(argc, argv, spitz_debug_runner);
+    spits_main_async(argc, argv, spitz_debug_runner, spitz_debug_submit,
+        spitz_debug_wait);
+
+    // Jobs that were never waited for still run to completion
+    const void* p;
+    spitssize_t sz;
+    for (size_t i = 0; i < spitz_debug_jobs.size(); i++)
+        spitz_debug_wait(spitz_debug_jobs[i], &p, &sz);
+    delete spitz_debug_the_pool;
     std::cerr << "[SPITZ] Spitz finished." << std::endl;
 }
 #endif